@@ -0,0 +1,247 @@
+// batch perft: perft of a stream of positions on all the threads, results written in input order
+#include "chess.h"
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <vector>
+#include <string>
+
+/*
+  Input: one position per line, "[<depth>] <fen>" (the -depth given on the command line if there's no
+  depth), empty lines and lines starting with '#' are skipped
+  Output: one line for every position, in the order of the input: "<depth> <count> <fen>"
+  ("<depth> error <fen>" if the depth is missing or out of range, or the FEN isn't valid: see Utils::parseFEN)
+  The input can also be a corpus file (see PositionCorpus.cpp): the positions are read from the mapped file,
+  all at the depth given on the command line.
+
+  The reader (the calling thread) puts the positions in a ring of BATCH_WINDOW slots, the worker
+  threads take them in turn and write the counts in the slots, and a writer thread writes the slots out
+  in order. The reader waits when the ring is full, i.e. when the writer is behind (e.g. the output is
+  a slow pipe), or a position that takes long keeps the ones after it from being written; so memory use
+  is bounded however long the input is.
+*/
+
+#define BATCH_WINDOW        4096    // positions read but not yet written
+#define BATCH_FETCH         16      // positions taken by a worker at a time
+
+struct BatchSlot
+{
+    BoardPosition pos;
+    int    depth;
+    uint64 count;
+    bool   valid;
+    bool   done;
+    char   fen[MAX_FEN_LENGTH];
+};
+
+static BatchSlot               *slots;
+static std::mutex               batchLock;
+static std::condition_variable  jobsAvailable;      // positions read (or end of input)
+static std::condition_variable  slotDone;           // a count is ready (for the writer)
+static std::condition_variable  slotFree;           // a slot was written out (for the reader)
+static uint64                   nRead;              // positions read so far
+static uint64                   nTaken;             // positions taken by the workers
+static uint64                   nWritten;           // positions written out
+static bool                     endOfInput;
+
+static void batchWorker(uint32 thread, bool hashed)
+{
+    Numa::pinThread(thread);
+    PerftHashTable::selectPartition(Numa::threadNode(thread));
+
+    for (;;)
+    {
+        uint64 first, last;
+        {
+            std::unique_lock<std::mutex> guard(batchLock);
+            while (nTaken == nRead && !endOfInput)
+                jobsAvailable.wait(guard);
+            if (nTaken == nRead)
+                return;
+
+            first = nTaken;
+            last = nRead - nTaken > BATCH_FETCH ? nTaken + BATCH_FETCH : nRead;
+            nTaken = last;
+        }
+
+        for (uint64 i = first; i < last; i++)
+        {
+            BatchSlot *slot = &slots[i % BATCH_WINDOW];
+            if (slot->valid)
+                slot->count = hashed ? perftHashed<MoveGenerator>(&slot->pos, slot->depth) :
+                                       perft<MoveGenerator>(&slot->pos, slot->depth);
+        }
+
+        std::lock_guard<std::mutex> guard(batchLock);
+        for (uint64 i = first; i < last; i++)
+            slots[i % BATCH_WINDOW].done = true;
+        slotDone.notify_one();
+    }
+}
+
+static void batchWriter(FILE *out, uint64 *totalNodes)
+{
+    for (;;)
+    {
+        uint64 first, last;
+        {
+            std::unique_lock<std::mutex> guard(batchLock);
+            while (!(nWritten < nRead && slots[nWritten % BATCH_WINDOW].done) && !(nWritten == nRead && endOfInput))
+                slotDone.wait(guard);
+            if (nWritten == nRead)
+                return;
+
+            // all the slots done in order (they aren't touched by the others till they are freed)
+            first = nWritten;
+            last = first;
+            while (last < nRead && slots[last % BATCH_WINDOW].done)
+                last++;
+        }
+
+        for (uint64 i = first; i < last; i++)
+        {
+            BatchSlot *slot = &slots[i % BATCH_WINDOW];
+            if (slot->valid)
+            {
+                fprintf(out, "%d %llu %s\n", slot->depth, slot->count, slot->fen);
+                *totalNodes += slot->count;
+            }
+            else
+            {
+                fprintf(out, "%d error %s\n", slot->depth, slot->fen);
+            }
+        }
+
+        // flushed after every group of lines: a consumer reading one result at a time sees it right away,
+        // and under load the groups are big
+        fflush(out);
+
+        std::lock_guard<std::mutex> guard(batchLock);
+        for (uint64 i = first; i < last; i++)
+            slots[i % BATCH_WINDOW].done = false;
+        nWritten = last;
+        slotFree.notify_one();
+    }
+}
+
+// parses an input line, returns false if it's not a position
+static bool parseLine(char *line, int defaultDepth, BatchSlot *slot)
+{
+    line[strcspn(line, "\r\n")] = 0;
+    while (*line == ' ' || *line == '\t')
+        line++;
+    if (!*line || *line == '#')
+        return false;
+
+    // a depth is a number followed by a space, the first field of a FEN has '/'s
+    slot->depth = defaultDepth;
+    size_t digits = strspn(line, "0123456789");
+    if (digits && (line[digits] == ' ' || line[digits] == '\t'))
+    {
+        slot->depth = atoi(line);
+        line += digits;
+        while (*line == ' ' || *line == '\t')
+            line++;
+    }
+
+    sprintf(slot->fen, "%.127s", line);
+    slot->valid = Utils::parseFEN(line, &slot->pos) && slot->depth >= 1 && slot->depth < MAX_PERFT_DEPTH;
+    slot->count = 0;
+    return true;
+}
+
+// waits for the slot of the next position to be free (nobody else touches it till nRead is moved past it)
+static BatchSlot *nextSlot()
+{
+    std::unique_lock<std::mutex> guard(batchLock);
+    while (nRead - nWritten == BATCH_WINDOW)
+        slotFree.wait(guard);
+    return &slots[nRead % BATCH_WINDOW];
+}
+
+// hands the position in the slot to the workers
+static void slotRead()
+{
+    std::lock_guard<std::mutex> guard(batchLock);
+    nRead++;
+    jobsAvailable.notify_one();
+}
+
+int BatchPerft::run(const char *inputFile, int defaultDepth, bool hashed)
+{
+    PositionCorpus corpus;
+    bool binary = inputFile && corpus.open(inputFile);
+
+    FILE *in = NULL;
+    if (!binary)
+    {
+        in = inputFile ? fopen(inputFile, "r") : stdin;
+        if (!in)
+        {
+            printf("can't open %s\n", inputFile);
+            return 1;
+        }
+    }
+
+    std::vector<BatchSlot> ring(BATCH_WINDOW);
+    slots = &ring[0];
+    nRead = nTaken = nWritten = 0;
+    endOfInput = false;
+
+    // output is written in blocks (see batchWriter)
+    static char outputBuffer[1024 * 1024];
+    setvbuf(stdout, outputBuffer, _IOFBF, sizeof(outputBuffer));
+
+    std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+
+    uint32 nThreads = ParallelPerft::threadCount();
+    std::vector<std::thread> workers;
+    for (uint32 i = 0; i < nThreads; i++)
+        workers.push_back(std::thread(batchWorker, i, hashed));
+
+    uint64 totalNodes = 0;
+    std::thread writer(batchWriter, stdout, &totalNodes);
+
+    if (binary)
+    {
+        for (uint64 i = 0; i < corpus.count; i++)
+        {
+            BatchSlot *slot = nextSlot();
+            Utils::unpackPosition(&corpus.positions[i], &slot->pos);
+            Utils::getFENString(&slot->pos, slot->fen, -1);
+            slot->depth = defaultDepth;
+            slot->valid = slot->depth >= 1 && slot->depth < MAX_PERFT_DEPTH;
+            slot->count = 0;
+            slotRead();
+        }
+    }
+    else
+    {
+        char line[1024];
+        while (fgets(line, sizeof(line), in))
+        {
+            if (parseLine(line, defaultDepth, nextSlot()))
+                slotRead();
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> guard(batchLock);
+        endOfInput = true;
+        jobsAvailable.notify_all();
+        slotDone.notify_all();
+    }
+
+    for (uint32 i = 0; i < nThreads; i++)
+        workers[i].join();
+    writer.join();
+    fflush(stdout);
+
+    if (in && inputFile)
+        fclose(in);
+
+    double seconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+    fprintf(stderr, "%llu positions, %llu nodes in %g seconds (%g positions/s, nps: %llu) on %u threads\n", nRead,
+            totalNodes, seconds, nRead / seconds, (uint64) (totalNodes / seconds), nThreads);
+    return 0;
+}
@@ -0,0 +1,410 @@
+// perft spread over worker processes (on this host or others), connected to a coordinator by TCP
+#include "chess.h"
+#include <vector>
+#include <deque>
+#include <string>
+#include <algorithm>
+
+#ifndef _WIN32
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <poll.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+/*
+  The coordinator expands the tree to the split depth; every path from the root to the split depth is
+  a work unit. Units are handed out to the workers over their connections, a few at a time, and the
+  counts are added up as they come back. Workers share no memory (each has its own hash table), so they
+  can run on other hosts too.
+
+  Protocol (text lines):
+
+  coordinator -> worker:  unit <id> <depth> fen <fen> [moves <move1> <move2> ...]
+                          perft <depth> of the position after the moves (UCI notation) from the FEN
+  worker -> coordinator:  result <id> <count>
+
+  A worker that goes away (crash, killed, host down) closes its connection; the units it had are
+  handed to the other workers again. Local worker processes that die are restarted.
+  The coordinator closes the connections when all the units are done, and the workers exit.
+
+  There is no authentication: the coordinator listens on localhost only, unless an address is given
+  (-bind) for workers on other hosts, which should then be a trusted network. Results are only taken
+  for units that are outstanding on the connection they come from, anything else is ignored.
+*/
+
+#define UNITS_PER_WORKER    2       // units sent ahead, so that a worker doesn't wait for its next unit
+#define MAX_RESTARTS_PER_WORKER 2   // local worker processes restarted (after crashes) at most this many times
+
+#ifndef _WIN32
+
+struct WorkUnit
+{
+    std::string moves;      // path from the root, e.g. "e2e4 e7e5"
+    uint64 count;
+    bool   done;
+};
+
+struct WorkerConnection
+{
+    int fd;
+    std::string input;              // received, not yet complete line
+    std::vector<uint32> assigned;   // units sent to the worker and not done yet
+};
+
+// collects the paths to all positions at the split depth
+static void collectUnits(BoardPosition *pos, int depth, const std::string &path, std::vector<WorkUnit> &units)
+{
+    if (depth == 0)
+    {
+        WorkUnit unit;
+        unit.moves = path;
+        unit.count = 0;
+        unit.done = false;
+        units.push_back(unit);
+        return;
+    }
+
+    Move moves[MAX_MOVES];
+    uint32 nMoves = MoveGenerator::generateMoves(pos, moves);
+    for (uint32 i = 0; i < nMoves; i++)
+    {
+        char moveStr[6];
+        Utils::getMoveString(moves[i], moveStr);
+
+        BoardPosition newPos = *pos;
+        makeMove(&newPos, moves[i]);
+        collectUnits(&newPos, depth - 1, path.empty() ? moveStr : path + " " + moveStr, units);
+    }
+}
+
+// the sockets of the coordinator must not be inherited by the worker processes it starts
+// (a worker holding a copy of another worker's connection would keep it open)
+static void closeOnExec(int fd)
+{
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+}
+
+static bool sendAll(int fd, const std::string &data)
+{
+    size_t sent = 0;
+    while (sent < data.size())
+    {
+        ssize_t n = send(fd, data.c_str() + sent, data.size() - sent, MSG_NOSIGNAL);
+        if (n <= 0)
+            return false;
+        sent += n;
+    }
+    return true;
+}
+
+// starts a local worker process (this program with -worker), returns its pid (or -1)
+static pid_t startWorker(int port, uint64 hashSizeInMB)
+{
+    char address[64], hashSize[32];
+    sprintf(address, "127.0.0.1:%d", port);
+    sprintf(hashSize, "%llu", hashSizeInMB);
+
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        if (hashSizeInMB)
+            execl("/proc/self/exe", "perft", "-worker", address, "-hash", hashSize, (char *) NULL);
+        else
+            execl("/proc/self/exe", "perft", "-worker", address, (char *) NULL);
+        _exit(127);
+    }
+    return pid;
+}
+
+uint64 DistributedPerft::perft(const char *fen, int depth, int splitDepth, uint32 nLocalWorkers, int port,
+                               const char *bindAddress, uint64 hashSizeInMB)
+{
+    // at least one ply is left for the workers
+    if (splitDepth >= depth)
+        splitDepth = depth - 1;
+
+    BoardPosition pos;
+    Utils::readFENString(fen, &pos);
+
+    if (splitDepth < 1)
+        return ::perft<MoveGenerator>(&pos, depth);
+
+    std::vector<WorkUnit> units;
+    collectUnits(&pos, splitDepth, "", units);
+
+    std::deque<uint32> pending;
+    for (uint32 i = 0; i < units.size(); i++)
+        pending.push_back(i);
+
+    // without a bind address, only workers on this host can connect
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons((uint16) port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bindAddress && inet_pton(AF_INET, bindAddress, &addr.sin_addr) != 1)
+    {
+        printf("invalid bind address %s (must be an IPv4 address)\n", bindAddress);
+        exit(1);
+    }
+
+    int listenFd = socket(AF_INET, SOCK_STREAM, 0);
+    closeOnExec(listenFd);
+    int yes = 1;
+    setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+
+    socklen_t addrLength = sizeof(addr);
+    if (listenFd < 0 || bind(listenFd, (sockaddr *) &addr, sizeof(addr)) || listen(listenFd, 64) ||
+        getsockname(listenFd, (sockaddr *) &addr, &addrLength))
+    {
+        printf("can't listen on port %d\n", port);
+        exit(1);
+    }
+    port = ntohs(addr.sin_port);
+
+    signal(SIGPIPE, SIG_IGN);
+    printf("%llu work units of perft %d, coordinator on port %d\n", (uint64) units.size(), depth - splitDepth, port);
+    fflush(stdout);
+
+    uint32 nLocal = 0, nRestarts = 0;
+    for (uint32 i = 0; i < nLocalWorkers; i++)
+        if (startWorker(port, hashSizeInMB) > 0)
+            nLocal++;
+
+    std::vector<WorkerConnection> workers;
+    uint64 nDone = 0, nReassigned = 0, total = 0;
+    uint32 nWorkersSeen = 0;
+    std::string fenPrefix = std::string(" fen ") + fen;
+
+    while (nDone < units.size())
+    {
+        // hand out units
+        for (size_t w = 0; w < workers.size(); w++)
+        {
+            std::string message;
+            while (workers[w].assigned.size() < UNITS_PER_WORKER && !pending.empty())
+            {
+                uint32 id = pending.front();
+                pending.pop_front();
+                if (units[id].done)
+                    continue;
+
+                char header[64];
+                sprintf(header, "unit %u %d", id, depth - splitDepth);
+                message += header + fenPrefix;
+                if (!units[id].moves.empty())
+                    message += " moves " + units[id].moves;
+                message += "\n";
+                workers[w].assigned.push_back(id);
+            }
+            if (!message.empty())
+                sendAll(workers[w].fd, message);    // a failure shows up as a closed connection below
+        }
+
+        std::vector<pollfd> fds(workers.size() + 1);
+        fds[0].fd = listenFd;
+        fds[0].events = POLLIN;
+        for (size_t w = 0; w < workers.size(); w++)
+        {
+            fds[w + 1].fd = workers[w].fd;
+            fds[w + 1].events = POLLIN;
+        }
+        poll(&fds[0], fds.size(), 1000);
+
+        if (fds[0].revents & POLLIN)
+        {
+            int fd = accept(listenFd, NULL, NULL);
+            if (fd >= 0)
+            {
+                closeOnExec(fd);
+                setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+                WorkerConnection worker;
+                worker.fd = fd;
+                workers.push_back(worker);
+                nWorkersSeen++;
+            }
+        }
+
+        for (size_t w = workers.size(); w-- > 0; )
+        {
+            if (w + 1 >= fds.size() || !fds[w + 1].revents)
+                continue;
+
+            char buffer[4096];
+            ssize_t n = recv(workers[w].fd, buffer, sizeof(buffer), 0);
+            if (n <= 0)
+            {
+                // the worker is gone: its units go to the others
+                for (size_t i = 0; i < workers[w].assigned.size(); i++)
+                    pending.push_front(workers[w].assigned[i]);
+                nReassigned += workers[w].assigned.size();
+                close(workers[w].fd);
+                workers.erase(workers.begin() + w);
+                continue;
+            }
+
+            workers[w].input.append(buffer, n);
+            size_t end;
+            while ((end = workers[w].input.find('\n')) != std::string::npos)
+            {
+                std::string line = workers[w].input.substr(0, end);
+                workers[w].input.erase(0, end + 1);
+
+                uint32 id;
+                uint64 count;
+                if (sscanf(line.c_str(), "result %u %llu", &id, &count) != 2 || id >= units.size())
+                    continue;
+
+                // only units sent on this connection (and not done yet) are taken
+                std::vector<uint32>::iterator assigned =
+                    std::find(workers[w].assigned.begin(), workers[w].assigned.end(), id);
+                if (assigned == workers[w].assigned.end())
+                    continue;
+                workers[w].assigned.erase(assigned);
+
+                // a reassigned unit can come back twice
+                if (!units[id].done)
+                {
+                    units[id].done = true;
+                    units[id].count = count;
+                    total += count;
+                    nDone++;
+                }
+            }
+        }
+
+        // restart local workers that died
+        pid_t pid;
+        int status;
+        while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
+        {
+            nLocal--;
+            if (nRestarts < MAX_RESTARTS_PER_WORKER * nLocalWorkers && startWorker(port, hashSizeInMB) > 0)
+            {
+                nLocal++;
+                nRestarts++;
+            }
+        }
+
+        if (workers.empty() && !nLocal && !port)
+        {
+            printf("all the workers are gone, %llu of %llu units done\n", nDone, (uint64) units.size());
+            exit(1);
+        }
+    }
+
+    // workers exit when their connection is closed
+    for (size_t w = 0; w < workers.size(); w++)
+        close(workers[w].fd);
+    close(listenFd);
+    while (nLocal && waitpid(-1, NULL, 0) > 0)
+        nLocal--;
+
+    printf("%llu units done by %u workers (%llu reassigned, %u local workers restarted)\n", (uint64) units.size(),
+           nWorkersSeen, nReassigned, nRestarts);
+    return total;
+}
+
+// connects to the coordinator and runs work units till the coordinator closes the connection
+int DistributedPerft::worker(const char *address, bool hashed)
+{
+    char host[256];
+    const char *colon = strrchr(address, ':');
+    if (!colon || colon - address >= (int) sizeof(host))
+    {
+        printf("worker: coordinator address must be <host>:<port>\n");
+        return 1;
+    }
+    memcpy(host, address, colon - address);
+    host[colon - address] = 0;
+
+    addrinfo hints, *result;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, colon + 1, &hints, &result))
+    {
+        printf("worker: can't resolve %s\n", host);
+        return 1;
+    }
+
+    int fd = socket(result->ai_family, result->ai_socktype, result->ai_protocol);
+    if (fd < 0 || connect(fd, result->ai_addr, result->ai_addrlen))
+    {
+        printf("worker: can't connect to %s\n", address);
+        freeaddrinfo(result);
+        return 1;
+    }
+    freeaddrinfo(result);
+
+    int yes = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+
+    FILE *in = fdopen(fd, "r");
+    char line[8192];
+    while (fgets(line, sizeof(line), in))
+    {
+        uint32 id;
+        int depth, n = 0;
+        if (sscanf(line, "unit %u %d fen%n", &id, &depth, &n) != 2 || !n)
+            continue;
+
+        char *fen = line + n;
+        char *moves = strstr(fen, " moves ");
+        if (moves)
+            *moves = 0;     // so that the FEN parser doesn't see the moves
+
+        BoardPosition pos;
+        bool legal = Utils::parseFEN(fen, &pos) && depth >= 1 && depth < MAX_PERFT_DEPTH;
+        if (moves)
+        {
+            char *params = moves + 7;
+            for (char *token = strtok(params, " \r\n"); token && legal; token = strtok(NULL, " \r\n"))
+            {
+                Move move;
+                legal = Utils::readMove(token, &pos, &move);
+                if (legal)
+                    makeMove(&pos, move);
+            }
+        }
+        if (!legal)
+        {
+            printf("worker: invalid unit: %s", line);
+            break;
+        }
+
+        uint64 count = hashed ? perftHashed<MoveGenerator>(&pos, depth) : ::perft<MoveGenerator>(&pos, depth);
+
+        char reply[64];
+        sprintf(reply, "result %u %llu\n", id, count);
+        if (!sendAll(fd, reply))
+            break;
+    }
+
+    fclose(in);
+    return 0;
+}
+
+#else
+
+uint64 DistributedPerft::perft(const char *fen, int depth, int splitDepth, uint32 nLocalWorkers, int port,
+                               const char *bindAddress, uint64 hashSizeInMB)
+{
+    printf("distributed perft isn't supported on windows\n");
+    exit(1);
+}
+
+int DistributedPerft::worker(const char *address, bool hashed)
+{
+    printf("distributed perft isn't supported on windows\n");
+    return 1;
+}
+
+#endif
@@ -0,0 +1,389 @@
+// frontier perft with the frontier kept on disk (external memory)
+#include "chess.h"
+#include <vector>
+#include <string>
+#include <queue>
+#include <algorithm>
+#ifdef _WIN32
+#include <direct.h>
+#include <process.h>
+#else
+#include <unistd.h>
+#endif
+
+// Same approach as FrontierPerft (expand one ply at a time, merge identical positions), but the positions
+// of a ply are stored in a file of packed records sorted by position, with no duplicates:
+//
+//   1. the positions of the previous ply are read from its file and expanded, the children are
+//      collected in a buffer (of bounded size); a full buffer is sorted, duplicates in it are merged,
+//      and it's written to a run file
+//   2. the run files are merged (k-way merge), adding up the multiplicities of identical positions,
+//      into the file of the ply (runs are first merged in groups if there are too many of them)
+//   3. at the frontier ply, the file is read in batches and perft of the remaining depth is run on
+//      each batch in parallel
+//
+// All file I/O is sequential, memory use is bounded by memoryInMB (plus I/O buffers).
+// The files are kept in a new directory (perft_XXXXXX) in the given one, so that processes sharing a
+// directory don't use each other's files; it's removed with the files left in it at the end, also when the
+// process exits on an error.
+// ExternalFrontier::dump stops after step 2, and writes out the unique positions of the last ply (see LeafDump).
+
+// a position at the frontier, with the no of times it occurs
+struct FrontierRecord
+{
+    PackedPosition pos;
+    uint64 multiplicity;
+};
+CT_ASSERT(sizeof(FrontierRecord) == 40);
+
+#define IO_BUFFER_SIZE      (1024 * 1024)
+#define MAX_MERGE_FANIN     64              // run files merged at a time (each has an open file and I/O buffer)
+
+static bool recordLess(const FrontierRecord &a, const FrontierRecord &b)
+{
+    return memcmp(&a.pos, &b.pos, sizeof(PackedPosition)) < 0;
+}
+
+static bool samePosition(const FrontierRecord &a, const FrontierRecord &b)
+{
+    return !memcmp(&a.pos, &b.pos, sizeof(PackedPosition));
+}
+
+static std::string              workDir;        // the directory of this process ("" if not created)
+static std::vector<std::string>  tempFiles;      // files created in it and not removed yet
+
+static void removeWorkDir()
+{
+    for (size_t i = 0; i < tempFiles.size(); i++)
+        remove(tempFiles[i].c_str());
+    tempFiles.clear();
+
+    if (workDir.empty())
+        return;
+#ifdef _WIN32
+    _rmdir(workDir.c_str());
+#else
+    rmdir(workDir.c_str());
+#endif
+    workDir.clear();
+}
+
+static void createWorkDir(const char *dir)
+{
+    static bool cleanupRegistered = false;
+    if (!cleanupRegistered)
+    {
+        atexit(removeWorkDir);
+        cleanupRegistered = true;
+    }
+
+    std::string name = std::string(dir) + "/perft_XXXXXX";
+#ifdef _WIN32
+    static int nCreated = 0;
+    char suffix[32];
+    sprintf(suffix, "%d_%d", _getpid(), nCreated++);
+    name.replace(name.size() - 6, 6, suffix);
+    bool ok = _mkdir(name.c_str()) == 0;
+#else
+    bool ok = mkdtemp(&name[0]) != NULL;
+#endif
+    if (!ok)
+    {
+        printf("can't create a directory in %s\n", dir);
+        exit(1);
+    }
+    workDir = name;
+}
+
+static FILE *openFile(const std::string &name, const char *mode)
+{
+    FILE *fp = fopen(name.c_str(), mode);
+    if (!fp)
+    {
+        printf("can't open %s\n", name.c_str());
+        exit(1);
+    }
+    setvbuf(fp, NULL, _IOFBF, IO_BUFFER_SIZE);
+    return fp;
+}
+
+static void writeRecord(FILE *fp, const FrontierRecord &record)
+{
+    if (fwrite(&record, sizeof(FrontierRecord), 1, fp) != 1)
+    {
+        printf("error writing frontier file (out of disk space?)\n");
+        exit(1);
+    }
+}
+
+// a new file in the directory of the process
+static std::string tempFileName(const char *kind, int n)
+{
+    char name[64];
+    sprintf(name, "/%s_%d.bin", kind, n);
+    tempFiles.push_back(workDir + name);
+    return tempFiles.back();
+}
+
+static void removeTempFile(const std::string &name)
+{
+    remove(name.c_str());
+    tempFiles.erase(std::find(tempFiles.begin(), tempFiles.end(), name));
+}
+
+// sorts the buffer, merges duplicates and writes it to a new run file
+static void writeRun(std::vector<FrontierRecord> &buffer, const std::string &name)
+{
+    std::sort(buffer.begin(), buffer.end(), recordLess);
+
+    FILE *fp = openFile(name, "wb");
+    for (size_t i = 0; i < buffer.size(); )
+    {
+        FrontierRecord record = buffer[i++];
+        while (i < buffer.size() && samePosition(buffer[i], record))
+            record.multiplicity += buffer[i++].multiplicity;
+        writeRecord(fp, record);
+    }
+    fclose(fp);
+
+    buffer.clear();
+}
+
+struct MergeSource
+{
+    FILE *fp;
+    FrontierRecord record;      // current (smallest unread) record of the file
+};
+
+// orders the priority queue (of source indices) by the current records, smallest first
+struct MergeOrder
+{
+    std::vector<MergeSource> *sources;
+    bool operator()(int a, int b) const
+    {
+        return recordLess((*sources)[b].record, (*sources)[a].record);
+    }
+};
+
+// merges sorted run files into one (deleting them), returns the no of unique records written
+static uint64 mergeRuns(const std::vector<std::string> &runs, const std::string &output)
+{
+    std::vector<MergeSource> sources(runs.size());
+    MergeOrder order = { &sources };
+    std::priority_queue<int, std::vector<int>, MergeOrder> queue(order);
+
+    for (size_t i = 0; i < runs.size(); i++)
+    {
+        sources[i].fp = openFile(runs[i], "rb");
+        if (fread(&sources[i].record, sizeof(FrontierRecord), 1, sources[i].fp) == 1)
+            queue.push((int) i);
+    }
+
+    FILE *out = openFile(output, "wb");
+    FrontierRecord current;
+    uint64 nRecords = 0;
+
+    while (!queue.empty())
+    {
+        int i = queue.top();
+        queue.pop();
+
+        if (nRecords && samePosition(sources[i].record, current))
+        {
+            current.multiplicity += sources[i].record.multiplicity;
+        }
+        else
+        {
+            if (nRecords)
+                writeRecord(out, current);
+            current = sources[i].record;
+            nRecords++;
+        }
+
+        if (fread(&sources[i].record, sizeof(FrontierRecord), 1, sources[i].fp) == 1)
+            queue.push(i);
+    }
+
+    if (nRecords)
+        writeRecord(out, current);
+    fclose(out);
+
+    for (size_t i = 0; i < runs.size(); i++)
+    {
+        fclose(sources[i].fp);
+        removeTempFile(runs[i]);
+    }
+
+    return nRecords;
+}
+
+// steps 1 and 2 for every ply up to the frontier, returns the name of the file of the frontier ply
+// (in the directory of the process, removed with removeWorkDir)
+static std::string buildFrontier(BoardPosition *pos, int frontierDepth, const char *dir, uint64 memoryInMB)
+{
+    createWorkDir(dir);
+
+    int nFiles = 0;
+    std::vector<FrontierRecord> buffer;
+    size_t bufferSize = (size_t) (memoryInMB * 1024 * 1024 / sizeof(FrontierRecord));
+    if (bufferSize < 2 * MAX_MOVES)
+        bufferSize = 2 * MAX_MOVES;
+
+    // ply 0: just the root
+    std::string plyFile = tempFileName("ply", 0);
+    FILE *fp = openFile(plyFile, "wb");
+    FrontierRecord root;
+    Utils::packPosition(pos, &root.pos);
+    root.multiplicity = 1;
+    writeRecord(fp, root);
+    fclose(fp);
+
+    for (int ply = 1; ply <= frontierDepth; ply++)
+    {
+        buffer.reserve(bufferSize);
+
+        // 1. expand the positions of the previous ply into sorted runs
+        std::vector<std::string> runs;
+        uint64 nChildren = 0;
+
+        FILE *in = openFile(plyFile, "rb");
+        FrontierRecord parent;
+        while (fread(&parent, sizeof(FrontierRecord), 1, in) == 1)
+        {
+            BoardPosition parentPos;
+            Utils::unpackPosition(&parent.pos, &parentPos);
+
+            PackedMove moves[MAX_MOVES];
+            uint32 childBound;
+            uint32 nMoves = MoveGenerator::generateMoves(&parentPos, moves, &childBound);
+
+            if (buffer.size() + nMoves > bufferSize)
+            {
+                runs.push_back(tempFileName("run", nFiles++));
+                writeRun(buffer, runs.back());
+            }
+
+            for (uint32 i = 0; i < nMoves; i++)
+            {
+                BoardPosition childPos = parentPos;
+                makeMove(&childPos, moves[i]);
+                FrontierPerft::clearUselessEnPassent(&childPos);
+                if (Zobrist::useSymmetry)
+                {
+                    childPos.hash = Zobrist::computeHash(&childPos);
+                    Zobrist::computeSymmetricHashes(&childPos);
+                    FrontierPerft::canonicalize(&childPos);
+                }
+
+                FrontierRecord child;
+                Utils::packPosition(&childPos, &child.pos);
+                child.multiplicity = parent.multiplicity;
+                buffer.push_back(child);
+            }
+            nChildren += nMoves;
+        }
+        fclose(in);
+        removeTempFile(plyFile);
+
+        if (buffer.size() || runs.empty())
+        {
+            runs.push_back(tempFileName("run", nFiles++));
+            writeRun(buffer, runs.back());
+        }
+        std::vector<FrontierRecord>().swap(buffer);     // memory isn't needed for merging
+
+        uint32 nRuns = (uint32) runs.size();
+
+        // 2. merge the runs (in groups if there are too many to merge at once)
+        while (runs.size() > MAX_MERGE_FANIN)
+        {
+            std::vector<std::string> merged;
+            for (size_t i = 0; i < runs.size(); i += MAX_MERGE_FANIN)
+            {
+                size_t end = std::min(i + MAX_MERGE_FANIN, runs.size());
+                std::vector<std::string> group(runs.begin() + i, runs.begin() + end);
+                merged.push_back(tempFileName("run", nFiles++));
+                mergeRuns(group, merged.back());
+            }
+            runs.swap(merged);
+        }
+
+        plyFile = tempFileName("ply", ply);
+        uint64 nUnique = mergeRuns(runs, plyFile);
+
+        printf("ply %d: %llu children of unique positions, %llu unique (%u runs)\n", ply, nChildren, nUnique, nRuns);
+        fflush(stdout);
+    }
+
+    return plyFile;
+}
+
+uint64 ExternalFrontier::perft(BoardPosition *pos, int depth, int frontierDepth, bool hashed, const char *dir,
+                               uint64 memoryInMB)
+{
+    if (frontierDepth >= depth)
+        frontierDepth = depth - 1;
+
+    if (frontierDepth < 1)
+        return ::perft<MoveGenerator>(pos, depth);
+
+    std::string plyFile = buildFrontier(pos, frontierDepth, dir, memoryInMB);
+
+    // 3. perft of the unique frontier positions, a batch at a time
+    printf("perft %d of the unique positions on %u threads\n", depth - frontierDepth, ParallelPerft::threadCount());
+    fflush(stdout);
+
+    size_t batchSize = (size_t) (memoryInMB * 1024 * 1024 / sizeof(PerftWorkItem));
+    if (batchSize < 1)
+        batchSize = 1;
+
+    std::vector<PerftWorkItem> batch;
+    batch.reserve(batchSize);
+    uint64 total = 0;
+
+    FILE *in = openFile(plyFile, "rb");
+    FrontierRecord record;
+    for (;;)
+    {
+        bool more = fread(&record, sizeof(FrontierRecord), 1, in) == 1;
+        if (more)
+        {
+            PerftWorkItem item;
+            Utils::unpackPosition(&record.pos, &item.pos);
+            item.multiplicity = record.multiplicity;
+            item.count = 0;
+            batch.push_back(item);
+        }
+
+        if (batch.size() == batchSize || (!more && batch.size()))
+        {
+            total += ParallelPerft::run(&batch[0], batch.size(), depth - frontierDepth, hashed);
+            batch.clear();
+        }
+
+        if (!more)
+            break;
+    }
+    fclose(in);
+    removeWorkDir();
+
+    return total;
+}
+
+uint64 ExternalFrontier::dump(BoardPosition *pos, int depth, const char *dir, uint64 memoryInMB, LeafWriter *writer)
+{
+    std::string plyFile = buildFrontier(pos, depth, dir, memoryInMB);
+
+    uint64 nUnique = 0;
+    FILE *in = openFile(plyFile, "rb");
+    FrontierRecord record;
+    while (fread(&record, sizeof(FrontierRecord), 1, in) == 1)
+    {
+        writer->write(&record.pos);
+        nUnique++;
+    }
+    fclose(in);
+    removeWorkDir();
+
+    return nUnique;
+}
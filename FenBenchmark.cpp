@@ -0,0 +1,172 @@
+// FEN parser/serializer benchmark: positions per second of Utils::parseFEN and Utils::getFENString
+#include "chess.h"
+#include <vector>
+
+/*
+  Input: one FEN (or EPD record) per line, empty lines and lines starting with '#' are skipped.
+
+  The whole file is read in memory first (so disk speed isn't measured), then the lines are processed a
+  chunk at a time: the chunk is parsed, the positions are written back as FEN strings, and (outside the
+  timed parts) each string written is parsed again and compared with the original position, i.e. every
+  valid line is also a round trip test of the serializer.
+
+  A corpus file (see PositionCorpus.cpp) is benchmarked the same way, with the positions unpacked from the
+  mapped file instead of parsed (and packed instead of written), for comparison.
+*/
+
+#define FEN_BENCHMARK_CHUNK     4096        // lines parsed (and positions kept) at a time
+
+struct FenRecord
+{
+    BoardPosition pos;
+    int  halfMoveClock;
+    int  fullMoveNumber;
+    bool valid;
+};
+
+// unpacks all the positions of the corpus, a chunk at a time, and packs them again
+static int runCorpus(PositionCorpus *corpus)
+{
+    printf("%llu positions (%.1f MB)\n", corpus->count, corpus->count * sizeof(PackedPosition) / (1024.0 * 1024.0));
+    fflush(stdout);
+
+    std::vector<BoardPosition> positions(FEN_BENCHMARK_CHUNK);
+    double unpackTime = 0, packTime = 0;
+    uint64 nMismatches = 0;
+
+    for (uint64 first = 0; first < corpus->count; first += FEN_BENCHMARK_CHUNK)
+    {
+        uint64 n = corpus->count - first < FEN_BENCHMARK_CHUNK ? corpus->count - first : FEN_BENCHMARK_CHUNK;
+
+        std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+        for (uint64 i = 0; i < n; i++)
+            Utils::unpackPosition(&corpus->positions[first + i], &positions[i]);
+        std::chrono::high_resolution_clock::time_point unpacked = std::chrono::high_resolution_clock::now();
+
+        // packed again for the timing, and compared with the original (not timed)
+        for (uint64 i = 0; i < n; i++)
+        {
+            PackedPosition packed;
+            Utils::packPosition(&positions[i], &packed);
+            nMismatches += memcmp(&packed, &corpus->positions[first + i], sizeof(PackedPosition)) != 0;
+        }
+        std::chrono::high_resolution_clock::time_point packed = std::chrono::high_resolution_clock::now();
+
+        unpackTime += std::chrono::duration<double>(unpacked - start).count();
+        packTime += std::chrono::duration<double>(packed - unpacked).count();
+    }
+
+    printf("unpack:     %g seconds, %g positions/s\n", unpackTime, corpus->count / unpackTime);
+    printf("pack:       %g seconds, %g positions/s (with the comparison)\n", packTime, corpus->count / packTime);
+    printf("round trip: %llu mismatches\n", nMismatches);
+
+    return nMismatches ? 1 : 0;
+}
+
+int FenBenchmark::run(const char *inputFile)
+{
+    PositionCorpus corpus;
+    if (corpus.open(inputFile))
+        return runCorpus(&corpus);
+
+    FILE *fp = fopen(inputFile, "rb");
+    if (!fp)
+    {
+        printf("can't open %s\n", inputFile);
+        return 1;
+    }
+
+    fseek(fp, 0, SEEK_END);
+    long fileSize = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+
+    std::vector<char> text(fileSize + 1);
+    size_t nBytes = fread(&text[0], 1, fileSize, fp);
+    fclose(fp);
+    text[nBytes] = 0;
+
+    // split in lines
+    std::vector<const char *> lines;
+    for (char *line = &text[0]; *line; )
+    {
+        char *end = strchr(line, '\n');
+        if (end)
+            *end = 0;
+        if (*line && *line != '\r' && *line != '#')
+            lines.push_back(line);
+        if (!end)
+            break;
+        line = end + 1;
+    }
+
+    printf("%llu positions (%.1f MB)\n", (uint64) lines.size(), nBytes / (1024.0 * 1024.0));
+    fflush(stdout);
+
+    std::vector<FenRecord> records(FEN_BENCHMARK_CHUNK);
+    double parseTime = 0, writeTime = 0;
+    uint64 nInvalid = 0, nMismatches = 0, fenBytes = 0;
+
+    for (size_t first = 0; first < lines.size(); first += FEN_BENCHMARK_CHUNK)
+    {
+        size_t n = lines.size() - first < FEN_BENCHMARK_CHUNK ? lines.size() - first : FEN_BENCHMARK_CHUNK;
+
+        // 1. parse
+        std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+        for (size_t i = 0; i < n; i++)
+        {
+            FenRecord *record = &records[i];
+            record->valid = Utils::parseFEN(lines[first + i], &record->pos, NULL, &record->halfMoveClock,
+                                            &record->fullMoveNumber);
+        }
+        std::chrono::high_resolution_clock::time_point parsed = std::chrono::high_resolution_clock::now();
+
+        // 2. serialize
+        char fen[MAX_FEN_LENGTH];
+        for (size_t i = 0; i < n; i++)
+        {
+            FenRecord *record = &records[i];
+            if (record->valid)
+                fenBytes += Utils::getFENString(&record->pos, fen, record->halfMoveClock, record->fullMoveNumber);
+        }
+        std::chrono::high_resolution_clock::time_point written = std::chrono::high_resolution_clock::now();
+
+        parseTime += std::chrono::duration<double>(parsed - start).count();
+        writeTime += std::chrono::duration<double>(written - parsed).count();
+
+        // 3. round trip check (not timed)
+        for (size_t i = 0; i < n; i++)
+        {
+            FenRecord *record = &records[i];
+            if (!record->valid)
+            {
+                const char *error;
+                BoardPosition pos;
+                Utils::parseFEN(lines[first + i], &pos, &error);
+                if (nInvalid++ < 10)
+                    printf("line %llu: %s: %s\n", (uint64) (first + i + 1), error, lines[first + i]);
+                continue;
+            }
+
+            FenRecord copy;
+            Utils::getFENString(&record->pos, fen, record->halfMoveClock, record->fullMoveNumber);
+            copy.valid = Utils::parseFEN(fen, &copy.pos, NULL, &copy.halfMoveClock, &copy.fullMoveNumber);
+            if (!copy.valid || memcmp(&copy.pos, &record->pos, sizeof(BoardPosition)) ||
+                copy.halfMoveClock != record->halfMoveClock || copy.fullMoveNumber != record->fullMoveNumber)
+            {
+                if (nMismatches++ < 10)
+                    printf("round trip mismatch at line %llu: %s -> %s\n", (uint64) (first + i + 1),
+                           lines[first + i], fen);
+            }
+        }
+    }
+
+    uint64 nValid = lines.size() - nInvalid;
+    printf("%llu invalid\n", nInvalid);
+    printf("parse:     %g seconds, %g positions/s (%.1f MB/s)\n", parseTime, lines.size() / parseTime,
+           nBytes / (1024.0 * 1024.0) / parseTime);
+    printf("serialize: %g seconds, %g positions/s (%.1f MB/s)\n", writeTime, nValid / writeTime,
+           fenBytes / (1024.0 * 1024.0) / writeTime);
+    printf("round trip: %llu mismatches\n", nMismatches);
+
+    return nMismatches ? 1 : 0;
+}
@@ -0,0 +1,140 @@
+// perft with deduplication of the positions at the frontier ply
+#include "chess.h"
+#include <vector>
+#include <algorithm>
+
+// Different move orders often reach the same position (e.g. 1. Nf3 Nf6 2. Nc3 and 1. Nc3 Nf6 2. Nf3),
+// so the positions at a given ply have many duplicates. The tree is expanded one ply at a time, and
+// after every ply identical positions are merged into one, with a multiplicity of how many times it
+// occurred. Perft of the remaining depth is run once for every unique position at the frontier
+// (in parallel) and multiplied by its multiplicity.
+// With Zobrist::useSymmetry, positions are replaced by their canonical symmetric image, so that
+// symmetric positions (which have the same perft) are merged too.
+
+// the en-passent square only matters if an en-passent capture is possible
+// clearing it otherwise lets positions reached by a double push and by two single pushes merge
+void FrontierPerft::clearUselessEnPassent(BoardPosition *pos)
+{
+    if (!pos->enPassent)
+        return;
+
+    // the pawn that was just pushed (by the other side)
+    uint32 dst = INDEX088(pos->chance == WHITE ? 4 : 3, pos->enPassent - 1);
+    uint8 capturingPawn = COLOR_PIECE(pos->chance, PAWN);
+
+    if ((!((dst - 1) & 0x88) && pos->board[dst - 1] == capturingPawn) ||
+        (!((dst + 1) & 0x88) && pos->board[dst + 1] == capturingPawn))
+        return;
+
+    pos->hash ^= Zobrist::enPassentKeys[pos->enPassent];
+    pos->enPassent = 0;
+}
+
+void FrontierPerft::canonicalize(BoardPosition *pos)
+{
+    uint32 symmetry;
+    Zobrist::canonicalHash(pos, &symmetry);
+    if (!symmetry)
+        return;
+
+    BoardPosition image;
+    Utils::transformPosition(pos, symmetry, &image);
+    image.hash = Zobrist::computeHash(&image);
+    Zobrist::computeSymmetricHashes(&image);
+    *pos = image;
+}
+
+// identical positions are next to each other after sorting (by hash, and then by contents for hash collisions)
+static bool lessThan(const PerftWorkItem &a, const PerftWorkItem &b)
+{
+    if (a.pos.hash != b.pos.hash)
+        return a.pos.hash < b.pos.hash;
+    return memcmp(&a.pos, &b.pos, sizeof(BoardPosition)) < 0;
+}
+
+// merges identical positions (adding up their multiplicities)
+static void mergeDuplicates(std::vector<PerftWorkItem> &items)
+{
+    std::sort(items.begin(), items.end(), lessThan);
+
+    size_t nUnique = 0;
+    for (size_t i = 0; i < items.size(); i++)
+    {
+        if (nUnique && !memcmp(&items[nUnique - 1].pos, &items[i].pos, sizeof(BoardPosition)))
+            items[nUnique - 1].multiplicity += items[i].multiplicity;
+        else
+            items[nUnique++] = items[i];
+    }
+    items.resize(nUnique);
+}
+
+// positions one ply after the given (unique) positions
+static void expand(std::vector<PerftWorkItem> &items, std::vector<PerftWorkItem> &children)
+{
+    children.clear();
+
+    for (size_t i = 0; i < items.size(); i++)
+    {
+        BoardPosition *pos = &items[i].pos;
+        PackedMove moves[MAX_MOVES];
+        uint32 childBound;
+        uint32 nMoves = MoveGenerator::generateMoves(pos, moves, &childBound);
+
+        for (uint32 j = 0; j < nMoves; j++)
+        {
+            PerftWorkItem child;
+            child.pos = *pos;
+            makeMove(&child.pos, moves[j]);
+            child.pos.hash = Zobrist::updateHash(pos, &child.pos, moves[j]);
+            FrontierPerft::clearUselessEnPassent(&child.pos);
+            if (Zobrist::useSymmetry)
+            {
+                Zobrist::updateSymmetricHashes(pos, &child.pos, moves[j]);
+                FrontierPerft::canonicalize(&child.pos);
+            }
+            child.multiplicity = items[i].multiplicity;
+            child.count = 0;
+            children.push_back(child);
+        }
+    }
+}
+
+uint64 FrontierPerft::perft(BoardPosition *pos, int depth, int frontierDepth, bool hashed)
+{
+    // at least one ply is left for perft
+    if (frontierDepth >= depth)
+        frontierDepth = depth - 1;
+
+    if (frontierDepth < 1)
+        return ::perft<MoveGenerator>(pos, depth);
+
+    std::vector<PerftWorkItem> frontier(1), next;
+    frontier[0].pos = *pos;
+    frontier[0].pos.hash = Zobrist::computeHash(pos);
+    if (Zobrist::useSymmetry)
+    {
+        Zobrist::computeSymmetricHashes(&frontier[0].pos);
+        canonicalize(&frontier[0].pos);
+    }
+    frontier[0].multiplicity = 1;
+    frontier[0].count = 0;
+
+    for (int ply = 1; ply <= frontierDepth; ply++)
+    {
+        expand(frontier, next);
+        uint64 nPositions = next.size();
+        mergeDuplicates(next);
+        frontier.swap(next);
+
+        printf("ply %d: %llu children of unique positions, %llu unique\n", ply, nPositions, (uint64) frontier.size());
+    }
+    std::vector<PerftWorkItem>().swap(next);     // free the memory
+
+    printf("perft %d of the unique positions on %u threads\n", depth - frontierDepth, ParallelPerft::threadCount());
+    fflush(stdout);
+
+    if (frontier.empty())
+        return 0;
+
+    return ParallelPerft::run(&frontier[0], frontier.size(), depth - frontierDepth, hashed);
+}
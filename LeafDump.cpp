@@ -0,0 +1,437 @@
+// leaf dump: writes the positions at a given depth (the leaves of perft) to a file
+#include "chess.h"
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <vector>
+
+/*
+  The tree is walked (copy-make, like perft) on the calling thread, and every leaf is appended to a block in
+  memory. Full blocks are handed to an I/O thread that compresses and writes them, so generation doesn't wait
+  for write calls (it only waits if LEAF_BLOCKS_IN_FLIGHT blocks are already queued, i.e. the disk can't keep up).
+
+  Packed format (default):
+
+    LeafDumpHeader  64 bytes
+    blocks:         uint32 no of positions, uint32 compressed size, compressed data
+
+  A block holds up to LEAF_BLOCK_POSITIONS PackedPositions. Each position is XORed with the previous one of
+  the block (consecutive leaves are siblings or cousins, so most bytes are unchanged), and runs of zero bytes
+  are written as a zero followed by the length of the run (1 - 255). Blocks are independent (the first
+  position of a block is XORed with zeros). -makecorpus converts a dump to a corpus (PositionCorpus.cpp).
+
+  FEN format: one line per position (the 4 EPD fields), plain text, written in blocks by the I/O thread all
+  the same.
+*/
+
+#define LEAF_DUMP_MAGIC         "PERFTDMP"
+#define LEAF_DUMP_VERSION       1
+#define LEAF_BLOCK_SIZE         (LEAF_BLOCK_POSITIONS * sizeof(PackedPosition))
+#define LEAF_BLOCKS_IN_FLIGHT   8
+
+struct LeafDumpHeader
+{
+    char   magic[8];
+    uint32 version;
+    uint32 recordSize;      // sizeof(PackedPosition)
+    uint64 count;           // no of positions (set when the dump is complete)
+    uint8  reserved[40];
+};
+CT_ASSERT(sizeof(LeafDumpHeader) == 64);
+
+// compresses a block of packed positions (see above), returns the compressed size (at most 2x the input)
+static uint32 compressBlock(const PackedPosition *positions, uint32 n, uint8 *out)
+{
+    uint64 previous[4] = {0, 0, 0, 0};
+    uint8 *p = out;
+    uint32 zeros = 0;
+
+    for (uint32 i = 0; i < n; i++)
+    {
+        const uint64 *words = (const uint64 *) &positions[i];
+        for (uint32 w = 0; w < 4; w++)
+        {
+            uint64 delta = words[w] ^ previous[w];
+            previous[w] = words[w];
+
+            // unchanged words are common
+            if (!delta)
+            {
+                zeros += 8;
+                continue;
+            }
+
+            for (uint32 b = 0; b < 8; b++, delta >>= 8)
+            {
+                uint8 byte = (uint8) delta;
+                if (!byte)
+                {
+                    zeros++;
+                    continue;
+                }
+
+                for (; zeros; zeros -= zeros > 255 ? 255 : zeros)
+                {
+                    *p++ = 0;
+                    *p++ = (uint8) (zeros > 255 ? 255 : zeros);
+                }
+                *p++ = byte;
+            }
+        }
+    }
+
+    for (; zeros; zeros -= zeros > 255 ? 255 : zeros)
+    {
+        *p++ = 0;
+        *p++ = (uint8) (zeros > 255 ? 255 : zeros);
+    }
+
+    return (uint32) (p - out);
+}
+
+// reverses compressBlock, returns false if the data is corrupt
+static bool decompressBlock(const uint8 *in, uint32 size, PackedPosition *positions, uint32 n)
+{
+    uint8 *out = (uint8 *) positions;
+    uint8 *end = out + n * sizeof(PackedPosition);
+    const uint8 *inEnd = in + size;
+
+    while (in < inEnd)
+    {
+        if (*in)
+        {
+            if (out == end)
+                return false;
+            *out++ = *in++;
+            continue;
+        }
+
+        if (inEnd - in < 2 || !in[1] || end - out < in[1])
+            return false;
+        memset(out, 0, in[1]);
+        out += in[1];
+        in += 2;
+    }
+    if (out != end)
+        return false;
+
+    uint64 *words = (uint64 *) positions;
+    for (uint32 i = 4; i < n * 4; i++)
+        words[i] ^= words[i - 4];
+    return true;
+}
+
+
+/** LeafWriter **/
+
+struct LeafWriterState
+{
+    FILE  *fp;
+    bool   fen;
+    bool   error;
+    bool   closing;
+    uint64 fileSize;
+
+    std::thread                     ioThread;
+    std::mutex                      lock;
+    std::condition_variable         blockQueued;
+    std::condition_variable         blockDone;
+    std::deque<std::vector<uint8> > queue;      // full blocks, in order
+    std::vector<std::vector<uint8> > spare;     // written blocks, for reuse
+    std::vector<uint8>              current;    // the block being filled
+};
+
+static void ioThread(LeafWriterState *state)
+{
+    std::vector<uint8> compressed(2 * LEAF_BLOCK_SIZE + 8);
+
+    for (;;)
+    {
+        std::vector<uint8> block;
+        {
+            std::unique_lock<std::mutex> guard(state->lock);
+            while (state->queue.empty() && !state->closing)
+                state->blockQueued.wait(guard);
+            if (state->queue.empty())
+                return;
+            block.swap(state->queue.front());
+            state->queue.pop_front();
+        }
+
+        const uint8 *data = &block[0];
+        size_t size = block.size();
+        if (!state->fen)
+        {
+            uint32 n = (uint32) (block.size() / sizeof(PackedPosition));
+            uint32 compressedSize = compressBlock((const PackedPosition *) &block[0], n, &compressed[8]);
+            memcpy(&compressed[0], &n, 4);
+            memcpy(&compressed[4], &compressedSize, 4);
+            data = &compressed[0];
+            size = compressedSize + 8;
+        }
+
+        bool written = fwrite(data, 1, size, state->fp) == size;
+
+        std::lock_guard<std::mutex> guard(state->lock);
+        state->error = state->error || !written;
+        state->fileSize += size;
+        state->spare.push_back(std::vector<uint8>());
+        state->spare.back().swap(block);
+        state->blockDone.notify_one();
+    }
+}
+
+bool LeafWriter::open(const char *filename, bool fenFormat)
+{
+    state = new LeafWriterState;
+    state->fen = fen = fenFormat;
+    state->error = false;
+    state->closing = false;
+    state->fileSize = 0;
+    count = 0;
+
+    // the count is in the header (written at the end), so a packed dump can't go to a pipe
+    if (!strcmp(filename, "-") && fen)
+        state->fp = stdout;
+    else
+        state->fp = fopen(filename, "wb");
+
+    if (!state->fp)
+    {
+        delete state;
+        state = NULL;
+        return false;
+    }
+
+    if (!fen)
+    {
+        LeafDumpHeader header;
+        memset(&header, 0, sizeof(header));
+        fwrite(&header, sizeof(header), 1, state->fp);
+        state->fileSize = sizeof(header);
+    }
+
+    state->current.resize(LEAF_BLOCK_SIZE);
+    block = &state->current[0];
+    blockUsed = 0;
+
+    state->ioThread = std::thread(ioThread, state);
+    return true;
+}
+
+void LeafWriter::flushBlock()
+{
+    state->current.resize(blockUsed);
+
+    std::unique_lock<std::mutex> guard(state->lock);
+    while (state->queue.size() >= LEAF_BLOCKS_IN_FLIGHT)
+        state->blockDone.wait(guard);
+
+    state->queue.push_back(std::vector<uint8>());
+    state->queue.back().swap(state->current);
+    state->blockQueued.notify_one();
+
+    if (!state->spare.empty())
+    {
+        state->current.swap(state->spare.back());
+        state->spare.pop_back();
+    }
+    guard.unlock();
+
+    state->current.resize(LEAF_BLOCK_SIZE);
+    block = &state->current[0];
+    blockUsed = 0;
+}
+
+void LeafWriter::write(BoardPosition *pos)
+{
+    if (fen)
+    {
+        if (blockUsed + MAX_FEN_LENGTH + 1 > LEAF_BLOCK_SIZE)
+            flushBlock();
+        blockUsed += Utils::getFENString(pos, (char *) block + blockUsed, -1);
+        block[blockUsed++] = '\n';
+    }
+    else
+    {
+        if (blockUsed == LEAF_BLOCK_SIZE)
+            flushBlock();
+        Utils::packPosition(pos, (PackedPosition *) (block + blockUsed));
+        blockUsed += sizeof(PackedPosition);
+    }
+    count++;
+}
+
+void LeafWriter::write(const PackedPosition *packed)
+{
+    if (fen)
+    {
+        BoardPosition pos;
+        Utils::unpackPosition(packed, &pos);
+        write(&pos);
+        return;
+    }
+
+    if (blockUsed == LEAF_BLOCK_SIZE)
+        flushBlock();
+    memcpy(block + blockUsed, packed, sizeof(PackedPosition));
+    blockUsed += sizeof(PackedPosition);
+    count++;
+}
+
+bool LeafWriter::close(uint64 *fileSize)
+{
+    if (blockUsed)
+        flushBlock();
+
+    {
+        std::lock_guard<std::mutex> guard(state->lock);
+        state->closing = true;
+        state->blockQueued.notify_one();
+    }
+    state->ioThread.join();
+
+    bool ok = !state->error;
+    if (!fen)
+    {
+        LeafDumpHeader header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, LEAF_DUMP_MAGIC, sizeof(header.magic));
+        header.version = LEAF_DUMP_VERSION;
+        header.recordSize = sizeof(PackedPosition);
+        header.count = count;
+
+        fseek(state->fp, 0, SEEK_SET);
+        ok = ok && fwrite(&header, sizeof(header), 1, state->fp) == 1;
+    }
+
+    if (state->fp == stdout)
+        ok = (fflush(stdout) == 0) && ok;
+    else
+        ok = (fclose(state->fp) == 0) && ok;
+
+    if (fileSize)
+        *fileSize = state->fileSize;
+
+    delete state;
+    state = NULL;
+    return ok;
+}
+
+
+/** LeafReader **/
+
+bool LeafReader::open(const char *filename)
+{
+    fp = fopen(filename, "rb");
+    if (!fp)
+        return false;
+
+    LeafDumpHeader header;
+    if (fread(&header, sizeof(header), 1, fp) != 1 || memcmp(header.magic, LEAF_DUMP_MAGIC, sizeof(header.magic)) ||
+        header.version != LEAF_DUMP_VERSION || header.recordSize != sizeof(PackedPosition))
+    {
+        fclose(fp);
+        fp = NULL;
+        return false;
+    }
+
+    count = header.count;
+    buffer = (uint8 *) malloc(2 * LEAF_BLOCK_SIZE);
+    return true;
+}
+
+uint32 LeafReader::readBlock(PackedPosition *positions)
+{
+    uint32 sizes[2];
+    if (fread(sizes, sizeof(sizes), 1, fp) != 1)
+        return 0;
+
+    uint32 n = sizes[0], compressedSize = sizes[1];
+    if (!n || n > LEAF_BLOCK_POSITIONS || compressedSize > 2 * LEAF_BLOCK_SIZE ||
+        fread(buffer, 1, compressedSize, fp) != compressedSize ||
+        !decompressBlock(buffer, compressedSize, positions, n))
+    {
+        printf("corrupt leaf dump\n");
+        return 0;
+    }
+
+    return n;
+}
+
+void LeafReader::close()
+{
+    if (fp)
+        fclose(fp);
+    free(buffer);
+    fp = NULL;
+    buffer = NULL;
+}
+
+
+/** LeafDump **/
+
+static void dumpLeaves(BoardPosition *pos, int depth, LeafWriter *writer)
+{
+    PackedMove moves[MAX_MOVES];
+    uint32 childBound;
+    uint32 nMoves = MoveGenerator::generateMoves(pos, moves, &childBound);
+
+    for (uint32 i = 0; i < nMoves; i++)
+    {
+        BoardPosition newPos = *pos;
+        makeMove(&newPos, moves[i]);
+        if (depth == 1)
+            writer->write(&newPos);
+        else
+            dumpLeaves(&newPos, depth - 1, writer);
+    }
+}
+
+int LeafDump::dump(BoardPosition *pos, int depth, const char *filename, bool fen, bool unique, const char *dir,
+                   uint64 memoryInMB)
+{
+    // with the FEN lines on stdout, the report goes to stderr
+    bool toStdout = fen && !strcmp(filename, "-");
+    FILE *report = toStdout ? stderr : stdout;
+
+    if (unique && toStdout)
+    {
+        fprintf(report, "unique positions can't be written to stdout (the frontier reports its progress there)\n");
+        return 1;
+    }
+
+    LeafWriter writer;
+    if (!writer.open(filename, fen))
+    {
+        fprintf(report, "can't create %s\n", filename);
+        return 1;
+    }
+
+    std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+
+    if (depth < 1)
+        writer.write(pos);
+    else if (unique)
+        ExternalFrontier::dump(pos, depth, dir, memoryInMB, &writer);
+    else
+        dumpLeaves(pos, depth, &writer);
+
+    uint64 fileSize;
+    bool ok = writer.close(&fileSize);
+    double seconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+
+    if (!ok)
+    {
+        fprintf(report, "error writing %s (out of disk space?)\n", filename);
+        return 1;
+    }
+
+    fprintf(report, "%llu %spositions at depth %d written in %g seconds (%g positions/s), %.1f MB", writer.count,
+            unique ? "unique " : "", depth, seconds, writer.count / seconds, fileSize / (1024.0 * 1024.0));
+    if (!fen)
+        fprintf(report, " (%.2f bytes per position)", (double) fileSize / (writer.count ? writer.count : 1));
+    fprintf(report, "\n");
+    return 0;
+}
@@ -0,0 +1,229 @@
+// uniform random sample of the positions at a given depth (the leaves of perft), without storing the tree
+#include "chess.h"
+#include <thread>
+#include <atomic>
+#include <vector>
+#include <math.h>
+
+/*
+  The tree is walked like perft, on all the threads, and every thread keeps a reservoir of k leaves
+  (reservoir sampling: after n leaves, the reservoir is a uniform random subset of k of them).
+
+  Leaves aren't made one at a time: a reservoir knows how many leaves to skip before it takes the next one
+  (Li's algorithm L, the skips are drawn from their distribution), so at the last ply the moves of a position
+  are only counted, as in perft, and only the few moves that are taken are made and packed. After the reservoir
+  is full, the no of leaves taken grows as k * log(n / k), so the walk costs about as much as perft.
+
+  The work is split at SAMPLE_SPLIT_PLY: the positions there are taken by the threads in turn. At the end the
+  reservoirs are merged into a single uniform sample: the next position comes from thread i with probability
+  (leaves of thread i not drawn yet) / (leaves not drawn yet), and is a random position of its reservoir not
+  drawn yet. This is exact (not weighted by estimates): the sample has the distribution of k positions drawn
+  without replacement from all the leaves, whatever the split.
+
+  With a given seed the sample is repeatable on a single thread (-threads 1); on more threads it also depends
+  on which thread took which position.
+*/
+
+#define SAMPLE_SPLIT_PLY    2
+
+// xorshift64*
+static uint64 random64(uint64 *state)
+{
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545F4914F6CDD1DULL;
+}
+
+// in (0, 1), never 0 (for the logs)
+static double randomUniform(uint64 *state)
+{
+    return ((random64(state) >> 11) + 0.5) * (1.0 / 9007199254740992.0);
+}
+
+struct Reservoir
+{
+    std::vector<PackedPosition> samples;
+    uint64 k;
+    uint64 seen;            // no of leaves walked
+    uint64 skip;            // no of leaves to skip before the next one is taken
+    double w;               // algorithm L state
+    uint64 randomState;
+
+    void init(uint64 size, uint64 seed)
+    {
+        samples.reserve(size);
+        k = size;
+        seen = 0;
+        skip = 0;
+        w = 1;
+        randomState = seed;
+    }
+
+    // draws the no of leaves skipped after the one just taken
+    void nextSkip()
+    {
+        double s = floor(log(randomUniform(&randomState)) / log(1 - w));
+        skip = s < 1e18 ? (uint64) s : (uint64) 1e18;
+    }
+
+    void take(BoardPosition *leaf)
+    {
+        if (samples.size() < k)
+        {
+            samples.resize(samples.size() + 1);
+            Utils::packPosition(leaf, &samples.back());
+            if (samples.size() < k)
+                return;     // skip stays 0 till the reservoir is full
+        }
+        else
+        {
+            Utils::packPosition(leaf, &samples[random64(&randomState) % k]);
+        }
+
+        w *= exp(log(randomUniform(&randomState)) / k);
+        nextSkip();
+    }
+};
+
+static void sampleLeaves(BoardPosition *pos, int depth, uint32 maxMoves, Reservoir *reservoir)
+{
+    PackedMove *moves = ALLOC_MOVE_LIST(maxMoves);
+    uint32 childMaxMoves;
+    uint32 nMoves = MoveGenerator::generateMoves(pos, moves, &childMaxMoves);
+
+    if (depth == 1)
+    {
+        // the moves skipped are only counted
+        uint64 remaining = nMoves;
+        while (reservoir->skip < remaining)
+        {
+            uint32 index = (uint32) (nMoves - remaining + reservoir->skip);
+            remaining -= reservoir->skip + 1;
+
+            BoardPosition leaf = *pos;
+            makeMove(&leaf, moves[index]);
+            reservoir->take(&leaf);
+        }
+        reservoir->skip -= remaining;
+        reservoir->seen += nMoves;
+        return;
+    }
+
+    for (uint32 i = 0; i < nMoves; i++)
+    {
+        BoardPosition newPos = *pos;
+        makeMove(&newPos, moves[i]);
+        sampleLeaves(&newPos, depth - 1, childMaxMoves, reservoir);
+    }
+}
+
+// the positions at the split ply (the work items of the threads)
+static void collectPositions(BoardPosition *pos, int depth, std::vector<BoardPosition> *positions)
+{
+    if (depth == 0)
+    {
+        positions->push_back(*pos);
+        return;
+    }
+
+    PackedMove moves[MAX_MOVES];
+    uint32 childBound;
+    uint32 nMoves = MoveGenerator::generateMoves(pos, moves, &childBound);
+    for (uint32 i = 0; i < nMoves; i++)
+    {
+        BoardPosition newPos = *pos;
+        makeMove(&newPos, moves[i]);
+        collectPositions(&newPos, depth - 1, positions);
+    }
+}
+
+static void sampler(uint32 thread, const std::vector<BoardPosition> *positions, std::atomic<uint64> *next,
+                    int depth, Reservoir *reservoir)
+{
+    Numa::pinThread(thread);
+
+    for (uint64 i; (i = (*next)++) < positions->size(); )
+    {
+        BoardPosition pos = (*positions)[i];
+        sampleLeaves(&pos, depth, MoveGenerator::movesBound(&pos), reservoir);
+    }
+}
+
+int LeafSampler::sample(BoardPosition *pos, int depth, uint64 k, uint64 seed, const char *filename, bool fen)
+{
+    // with the FEN lines on stdout, the report goes to stderr
+    bool toStdout = fen && !strcmp(filename, "-");
+    FILE *report = toStdout ? stderr : stdout;
+
+    LeafWriter writer;
+    if (!writer.open(filename, fen))
+    {
+        fprintf(report, "can't create %s\n", filename);
+        return 1;
+    }
+
+    if (!seed)
+        seed = (uint64) std::chrono::high_resolution_clock::now().time_since_epoch().count();
+
+    std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+
+    int splitPly = depth - 1 < SAMPLE_SPLIT_PLY ? depth - 1 : SAMPLE_SPLIT_PLY;
+    std::vector<BoardPosition> positions;
+    collectPositions(pos, splitPly, &positions);
+
+    uint32 nThreads = ParallelPerft::threadCount();
+    std::vector<Reservoir> reservoirs(nThreads);
+    std::vector<std::thread> threads;
+    std::atomic<uint64> next(0);
+    for (uint32 i = 0; i < nThreads; i++)
+    {
+        reservoirs[i].init(k, (seed + i) * 0x9E3779B97F4A7C15ULL | 1);     // xorshift state must not be zero
+        threads.push_back(std::thread(sampler, i, &positions, &next, depth - splitPly, &reservoirs[i]));
+    }
+
+    uint64 nLeaves = 0;
+    for (uint32 i = 0; i < nThreads; i++)
+    {
+        threads[i].join();
+        nLeaves += reservoirs[i].seen;
+    }
+
+    double walkSeconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+
+    // merge (see above)
+    uint64 randomState = seed * 0x9E3779B97F4A7C15ULL | 1;
+    std::vector<uint64> remaining(nThreads);
+    for (uint32 i = 0; i < nThreads; i++)
+        remaining[i] = reservoirs[i].seen;
+
+    uint64 nSamples = k < nLeaves ? k : nLeaves;
+    for (uint64 n = 0, notDrawn = nLeaves; n < nSamples; n++, notDrawn--)
+    {
+        uint64 r = random64(&randomState) % notDrawn;
+        uint32 t = 0;
+        while (r >= remaining[t])
+            r -= remaining[t++];
+        remaining[t]--;
+
+        std::vector<PackedPosition> &samples = reservoirs[t].samples;
+        uint64 index = random64(&randomState) % samples.size();
+        writer.write(&samples[index]);
+        samples[index] = samples.back();
+        samples.pop_back();
+    }
+
+    uint64 fileSize;
+    bool ok = writer.close(&fileSize);
+    double seconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+
+    if (!ok)
+    {
+        fprintf(report, "error writing %s (out of disk space?)\n", filename);
+        return 1;
+    }
+
+    fprintf(report, "%llu of %llu positions at depth %d sampled in %g seconds (walk: %g seconds, nps: %llu) on %u threads\n",
+            writer.count, nLeaves, depth, seconds, walkSeconds, (uint64) (nLeaves / walkSeconds), nThreads);
+    return 0;
+}
@@ -0,0 +1,266 @@
+// memory mapped files (used for persistent hash tables and position corpora) and large page allocations (for big tables)
+#include "chess.h"
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+// from linux/mman.h (not defined by older C libraries)
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT      26
+#endif
+#ifndef MAP_HUGE_2MB
+#define MAP_HUGE_2MB        (21 << MAP_HUGE_SHIFT)
+#endif
+#ifndef MAP_HUGE_1GB
+#define MAP_HUGE_1GB        (30 << MAP_HUGE_SHIFT)
+#endif
+#endif
+
+static uint64 roundUp(uint64 size, uint64 pageSize)
+{
+    return (size + pageSize - 1) & ~(pageSize - 1);
+}
+
+// maps the file in memory (read/write, shared)
+// if the file doesn't exist, it's created with the given size (filled with zeros)
+// if it exists, size is set to the size of the file and 'created' is set to false
+// returns NULL on failure
+void *Memory::mapFile(const char *filename, uint64 *size, bool *created)
+{
+#ifdef _WIN32
+    HANDLE file = CreateFileA(filename, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL, OPEN_ALWAYS,
+                              FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+        return NULL;
+
+    *created = (GetLastError() != ERROR_ALREADY_EXISTS);
+
+    LARGE_INTEGER fileSize;
+    GetFileSizeEx(file, &fileSize);
+    if (!*created && fileSize.QuadPart)
+        *size = fileSize.QuadPart;
+    else
+        *created = true;
+
+    // the file is extended to the mapping size (zero filled) if needed
+    HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READWRITE, (DWORD) (*size >> 32), (DWORD) *size, NULL);
+    CloseHandle(file);
+    if (!mapping)
+        return NULL;
+
+    void *ptr = MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, (SIZE_T) *size);
+    CloseHandle(mapping);     // the view keeps the mapping alive
+    return ptr;
+#else
+    int fd = open(filename, O_RDWR | O_CREAT, 0644);
+    if (fd < 0)
+        return NULL;
+
+    struct stat st;
+    fstat(fd, &st);
+    *created = (st.st_size == 0);
+    if (*created)
+    {
+        // sparse file: pages are allocated only when they are written to
+        if (ftruncate(fd, *size))
+        {
+            close(fd);
+            return NULL;
+        }
+    }
+    else
+    {
+        *size = st.st_size;
+    }
+
+    void *ptr = mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);      // the mapping keeps the file open
+    if (ptr == MAP_FAILED)
+        return NULL;
+
+#ifdef MADV_HUGEPAGE
+    // use transparent huge pages if the file system supports them (e.g. tmpfs mounted with huge=),
+    // files on hugetlbfs are always mapped with huge pages
+    madvise(ptr, *size, MADV_HUGEPAGE);
+#endif
+    // table probes are random
+    madvise(ptr, *size, MADV_RANDOM);
+
+    return ptr;
+#endif
+}
+
+// maps an existing file in memory, read only (e.g. a corpus of positions, read sequentially)
+// size is set to the size of the file
+// returns NULL on failure (or if the file is empty)
+const void *Memory::mapFileReadOnly(const char *filename, uint64 *size)
+{
+#ifdef _WIN32
+    HANDLE file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL,
+                              NULL);
+    if (file == INVALID_HANDLE_VALUE)
+        return NULL;
+
+    LARGE_INTEGER fileSize;
+    GetFileSizeEx(file, &fileSize);
+    *size = fileSize.QuadPart;
+    if (!*size)
+    {
+        CloseHandle(file);
+        return NULL;
+    }
+
+    HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    CloseHandle(file);
+    if (!mapping)
+        return NULL;
+
+    const void *ptr = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    CloseHandle(mapping);
+    return ptr;
+#else
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+
+    struct stat st;
+    fstat(fd, &st);
+    *size = st.st_size;
+    if (!*size)
+    {
+        close(fd);
+        return NULL;
+    }
+
+    void *ptr = mmap(NULL, *size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (ptr == MAP_FAILED)
+        return NULL;
+
+    // read ahead aggressively
+    madvise(ptr, *size, MADV_SEQUENTIAL);
+
+    return ptr;
+#endif
+}
+
+// unmaps a file mapped by mapFile or mapFileReadOnly (modified pages are written back to the file by the OS)
+void Memory::unmapFile(const void *ptr, uint64 size)
+{
+#ifdef _WIN32
+    UnmapViewOfFile(ptr);
+#else
+    munmap((void *) ptr, size);
+#endif
+}
+
+#ifndef _WIN32
+// transparent huge pages are used for madvise(MADV_HUGEPAGE) regions unless they are disabled ("[never]")
+static bool transparentHugePagesEnabled()
+{
+    char mode[128];
+    FILE *fp = fopen("/sys/kernel/mm/transparent_hugepage/enabled", "r");
+    if (!fp)
+        return false;
+    bool ok = fgets(mode, sizeof(mode), fp) != NULL;
+    fclose(fp);
+    return ok && !strstr(mode, "[never]");
+}
+#endif
+
+// Random probes of a table of many GB miss the TLB on almost every access with 4 KB pages (and the page
+// walk itself misses the cache); with 1 GB or 2 MB pages the TLB covers a lot more of the table.
+// Explicit huge pages must be reserved by the administrator (e.g. /proc/sys/vm/nr_hugepages on Linux, the
+// "Lock pages in memory" privilege on Windows), otherwise they are silently skipped.
+void *Memory::allocLarge(uint64 *size, uint64 *pageSize, bool *transparent)
+{
+    *transparent = false;
+
+#ifdef _WIN32
+    SIZE_T largePageSize = GetLargePageMinimum();
+    if (largePageSize && *size >= largePageSize)
+    {
+        uint64 largeSize = roundUp(*size, largePageSize);
+        void *ptr = VirtualAlloc(NULL, (SIZE_T) largeSize, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+        if (ptr)
+        {
+            *size = largeSize;
+            *pageSize = largePageSize;
+            return ptr;
+        }
+    }
+
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    *size = roundUp(*size, info.dwPageSize);
+    *pageSize = info.dwPageSize;
+    return VirtualAlloc(NULL, (SIZE_T) *size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+#else
+#ifdef MAP_HUGETLB
+    // explicit huge pages, the largest first (a table smaller than a page doesn't get the page)
+    static const uint64 hugePageSizes[] = { GIANT_PAGE_SIZE, HUGE_PAGE_SIZE };
+    static const int    hugePageFlags[] = { MAP_HUGE_1GB, MAP_HUGE_2MB };
+
+    for (int i = 0; i < 2; i++)
+    {
+        if (*size < hugePageSizes[i])
+            continue;
+
+        uint64 hugeSize = roundUp(*size, hugePageSizes[i]);
+        void *ptr = mmap(NULL, hugeSize, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | hugePageFlags[i], -1, 0);
+        if (ptr != MAP_FAILED)
+        {
+            *size = hugeSize;
+            *pageSize = hugePageSizes[i];
+            return ptr;
+        }
+    }
+#endif
+
+    *pageSize = sysconf(_SC_PAGESIZE);
+    if (*size < HUGE_PAGE_SIZE)
+    {
+        *size = roundUp(*size, *pageSize);
+        void *ptr = mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        return ptr == MAP_FAILED ? NULL : ptr;
+    }
+
+    // normal pages, aligned to 2 MB (the extra space around is unmapped) so that the kernel can back
+    // all of the table with transparent huge pages
+    *size = roundUp(*size, HUGE_PAGE_SIZE);
+    uint64 mappedSize = *size + HUGE_PAGE_SIZE;
+    uint8 *mapped = (uint8 *) mmap(NULL, mappedSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mapped == (uint8 *) MAP_FAILED)
+        return NULL;
+
+    uint8 *ptr = (uint8 *) roundUp((uint64) mapped, HUGE_PAGE_SIZE);
+    if (ptr > mapped)
+        munmap(mapped, ptr - mapped);
+    if (ptr + *size < mapped + mappedSize)
+        munmap(ptr + *size, mapped + mappedSize - (ptr + *size));
+
+#ifdef MADV_HUGEPAGE
+    if (!madvise(ptr, *size, MADV_HUGEPAGE) && transparentHugePagesEnabled())
+    {
+        *pageSize = HUGE_PAGE_SIZE;
+        *transparent = true;
+    }
+#endif
+
+    return ptr;
+#endif
+}
+
+// frees memory allocated by allocLarge (size as returned by it)
+void Memory::freeLarge(void *ptr, uint64 size)
+{
+#ifdef _WIN32
+    VirtualFree(ptr, 0, MEM_RELEASE);
+#else
+    munmap(ptr, size);
+#endif
+}
@@ -5,6 +5,12 @@
 // 1. for castling it's not checked if the squares are in check (major issue. need to be fixed)
 // 2. it's not checked if a move puts the king in check (can probably avoid checking this)
 
+// staged generation: moves of the stages that aren't wanted are skipped where they are found, before addMove
+// (the captures stage only adds moves to enemy pieces, en-passent and promotions; the quiets stage only moves
+// to empty squares). Rays are still walked to their end in both stages
+#define WANT_CAPTURES   (stageMask & BIT(STAGE_CAPTURES))
+#define WANT_QUIETS     (stageMask & BIT(STAGE_QUIETS))
+
 bool MoveGenerator::isInvalidMove(uint32 src, uint32 dst, uint8 oldPiece, uint8 flags)
 {
     // a move is illegal if it puts king in check! (or doesn't take the king out of check)
@@ -61,10 +67,19 @@ void MoveGenerator::addMove(uint32 src, uint32 dst, uint8 oldPiece, uint8 flags)
         return;
     }
 
-    moves[nMoves].src = (uint8) src;
-    moves[nMoves].dst = (uint8) dst;
-    moves[nMoves].capturedPiece = (uint8) oldPiece;
-    moves[nMoves].flags = flags;
+    if (packedMoves)
+    {
+        packedMoves[nMoves].src   = INDEX64(src);
+        packedMoves[nMoves].dst   = INDEX64(dst);
+        packedMoves[nMoves].flags = flags;
+    }
+    else
+    {
+        moves[nMoves].src = (uint8) src;
+        moves[nMoves].dst = (uint8) dst;
+        moves[nMoves].capturedPiece = (uint8) oldPiece;
+        moves[nMoves].flags = flags;
+    }
 
     /*
     Utils::displayMove(moves[nMoves]);
@@ -99,9 +114,10 @@ void MoveGenerator::generatePawnMoves(uint32 curPos)
         if(newRank == finalRank)
         {
             // promotion
-            addPromotions(curPos, newPos, EMPTY_SQUARE);
+            if (WANT_CAPTURES)
+                addPromotions(curPos, newPos, EMPTY_SQUARE);
         }
-        else
+        else if (WANT_QUIETS)
         {
             addMove(curPos, newPos, EMPTY_SQUARE, 0);
 
@@ -117,6 +133,9 @@ void MoveGenerator::generatePawnMoves(uint32 curPos)
     }
 
     // captures
+    if (!WANT_CAPTURES)
+        return;
+
     offset = chance ? -15 : 15;
     newPos = curPos + offset;
     uint32 capturedPiece = pos->board[newPos];
@@ -154,7 +173,7 @@ void MoveGenerator::generatePawnMoves(uint32 curPos)
     {
         uint32 enPassentFile = pos->enPassent - 1;
         uint32 enPassentRank = chance ? 3 : 4;
-        if ((curRank == enPassentRank) && (abs(FILE(curPos) - enPassentFile) == 1))
+        if ((curRank == enPassentRank) && (abs((int) FILE(curPos) - (int) enPassentFile) == 1))
         {
             uint32 finalRank = chance ? 2 : 5;
             newPos = INDEX088(finalRank, enPassentFile);
@@ -169,7 +188,7 @@ void MoveGenerator::generateOffsetedMove(uint32 curPos, uint32 offset)
     if(ISVALIDPOS(newPos))
     {
         uint8 capturedPiece = pos->board[newPos];
-        if (!IS_OF_COLOR(capturedPiece, chance))
+        if (!IS_OF_COLOR(capturedPiece, chance) && (!ISEMPTY(capturedPiece) ? WANT_CAPTURES : WANT_QUIETS))
             addMove(curPos, newPos, capturedPiece, 0);
     }
 }
@@ -184,7 +203,7 @@ void MoveGenerator::generateOffsetedMoves(uint32 curPos, const uint32 jumpTable[
 
 void MoveGenerator::generateKnightMoves(uint32 curPos)
 {
-    const uint32 jumpTable[] = {0x1F, 0x21, 0xE, 0x12, -0x12, -0xE, -0x21, -0x1F};
+    const uint32 jumpTable[] = {0x1F, 0x21, 0xE, 0x12, (uint32) -0x12, (uint32) -0xE, (uint32) -0x21, (uint32) -0x1F};
     generateOffsetedMoves(curPos, jumpTable, 8);
 }
 
@@ -194,10 +213,19 @@ void MoveGenerator::generateKingMoves(uint32 curPos)
     kingPos = 0xFF;
     
     // normal moves
-    const uint32 jumpTable[] = {0xF, 0x10, 0x11, 0x1, -0x1, -0x11, -0x10, -0xF};
+    const uint32 jumpTable[] = {0xF, 0x10, 0x11, 0x1, (uint32) -0x1, (uint32) -0x11, (uint32) -0x10, (uint32) -0xF};
     generateOffsetedMoves(curPos, jumpTable, 8);
 
     // castling
+    if (stageMask & BIT(STAGE_CASTLES))
+        generateCastles(curPos);
+
+    // restore the king's position
+    kingPos = curPos;
+}
+
+void MoveGenerator::generateCastles(uint32 curPos)
+{
     uint32 castleFlag = chance ? pos->blackCastle : pos->whiteCastle ;
 
     // no need to check for king's and rook's position as if they have moved, the castle flag would be zero
@@ -218,9 +246,6 @@ void MoveGenerator::generateKingMoves(uint32 curPos)
             addMove(curPos, curPos - 0x2, EMPTY_SQUARE, CASTLE_QUEEN_SIDE);
         }
     }
-
-    // restore the king's position
-    kingPos = curPos;
 }
 
 void MoveGenerator::generateSlidingMoves(const uint32 curPos, const uint32 offset)
@@ -234,13 +259,13 @@ void MoveGenerator::generateSlidingMoves(const uint32 curPos, const uint32 offse
             uint32 oldPiece = pos->board[newPos];
             if (!ISEMPTY(oldPiece))
             {
-                if(!IS_OF_COLOR(oldPiece,chance))
+                if(!IS_OF_COLOR(oldPiece,chance) && WANT_CAPTURES)
                 {
                     addMove(curPos, newPos, oldPiece, 0);
                 }
                 break;
             }
-            else
+            else if (WANT_QUIETS)
             {
                 addMove(curPos, newPos, EMPTY_SQUARE, 0);
             }
@@ -320,7 +345,7 @@ bool MoveGenerator::isThreatened(uint32 curPos, uint32 color)
     
     // check if threatened by knights
     pieceToCheck = COLOR_PIECE(color, KNIGHT);
-    const uint32 jumpTableKnights[] = {0x1F, 0x21, 0xE, 0x12, -0x12, -0xE, -0x21, -0x1F};
+    const uint32 jumpTableKnights[] = {0x1F, 0x21, 0xE, 0x12, (uint32) -0x12, (uint32) -0xE, (uint32) -0x21, (uint32) -0x1F};
     for (uint32 i=0; i < 8; i++)
     {
         offset   = jumpTableKnights[i];
@@ -331,7 +356,7 @@ bool MoveGenerator::isThreatened(uint32 curPos, uint32 color)
 
     // check if threatened by king
     pieceToCheck = COLOR_PIECE(color, KING);
-    const uint32 jumpTableKings[] = {0xF, 0x10, 0x11, 0x1, -0x1, -0x11, -0x10, -0xF};
+    const uint32 jumpTableKings[] = {0xF, 0x10, 0x11, 0x1, (uint32) -0x1, (uint32) -0x11, (uint32) -0x10, (uint32) -0xF};
     for (uint32 i=0; i < 8; i++)
     {
         offset   = jumpTableKings[i];
@@ -386,14 +411,14 @@ void MoveGenerator::generateMovesForSquare(uint32 index088, uint32 colorpiece)
     }
 }
 
-// generates moves for the given board position
-// returns the no of moves generated
-int MoveGenerator::generateMoves (BoardPosition *position, Move *generatedMoves)
+// generates moves for the given board position (into moves or packedMoves)
+// also computes childMovesBound
+void MoveGenerator::generateAllMoves(BoardPosition *position)
 {
     pos = position;
-    moves = generatedMoves;
     nMoves = 0;
     chance = pos->chance;
+    childMovesBound = 0;
 
    
     uint32 i, j;
@@ -404,6 +429,9 @@ int MoveGenerator::generateMoves (BoardPosition *position, Move *generatedMoves)
         if (ISVALIDPOS(i) && position->board[i] == kingPiece)
             kingPos = i;
 
+    // rank from which the opponent's pawns can promote
+    uint32 opponentPromotionRank = chance ? 6 : 1;
+
     // loop through all the squares in the board
     // TODO: maybe keep a list of squares containing white and black pieces?
     for (i = 0; i < 8; i++)
@@ -416,16 +444,133 @@ int MoveGenerator::generateMoves (BoardPosition *position, Move *generatedMoves)
             {
                 generateMovesForSquare(index088, piece);
             }
+            else
+            {
+                // opponent's pieces decide the size of move list needed for the next ply
+                // (our move can only remove an opponent's piece - never add one)
+                uint32 bound = pieceMovesBound[PIECE(piece)];
+                if ((PIECE(piece) == PAWN) && (i == opponentPromotionRank))
+                    bound = MAX_PROMOTING_PAWN_MOVES;
+                childMovesBound += bound;
+            }
         }
     }
+}
+
+// generates moves for the given board position
+// returns the no of moves generated
+int MoveGenerator::generateMoves (BoardPosition *position, Move *generatedMoves)
+{
+    moves = generatedMoves;
+    packedMoves = NULL;
+    generateAllMoves(position);
 
     return nMoves;
 }
 
+int MoveGenerator::generateMoves (BoardPosition *position, PackedMove *generatedMoves, uint32 *childBound)
+{
+    packedMoves = generatedMoves;
+    generateAllMoves(position);
+    *childBound = childMovesBound;
+
+    return nMoves;
+}
+
+// generates only the moves belonging to the given stage
+int MoveGenerator::generateMoves (BoardPosition *position, Move *generatedMoves, uint32 stage)
+{
+    moves = generatedMoves;
+    packedMoves = NULL;
+    stageMask = BIT(stage);
+
+    if (stage == STAGE_CASTLES)
+    {
+        // only the king can castle, no need to loop through the board
+        pos = position;
+        nMoves = 0;
+        chance = pos->chance;
+        uint32 kingPiece = COLOR_PIECE(chance, KING);
+        for (uint32 i = 0; i < 128; i++)
+        {
+            if (ISVALIDPOS(i) && position->board[i] == kingPiece)
+            {
+                kingPos = 0xFF;
+                generateCastles(i);
+            }
+        }
+    }
+    else
+    {
+        generateAllMoves(position);
+    }
+
+    stageMask = ALL_STAGES;
+    return nMoves;
+}
+
+// upper bound on no of moves for the given board position
+// (only needed at the root, for all other positions the bound is computed by generateMoves of the parent)
+uint32 MoveGenerator::movesBound(BoardPosition *position)
+{
+    uint32 bound = 0;
+    uint32 promotionRank = position->chance ? 1 : 6;
+    for (uint32 i = 0; i < 8; i++)
+    {
+        for (uint32 j = 0; j < 8; j++)
+        {
+            uint32 piece = position->board[INDEX088(i, j)];
+            if(IS_OF_COLOR(piece, position->chance))
+            {
+                if ((PIECE(piece) == PAWN) && (i == promotionRank))
+                    bound += MAX_PROMOTING_PAWN_MOVES;
+                else
+                    bound += pieceMovesBound[PIECE(piece)];
+            }
+        }
+    }
+
+    return bound;
+}
+
 
 // static members have to be defined seperately.. what the crap! ?
-BoardPosition *MoveGenerator::pos;
-Move *MoveGenerator::moves;
-uint32 MoveGenerator::nMoves;
-uint32 MoveGenerator::chance;
-uint32 MoveGenerator::kingPos;
\ No newline at end of file
+THREAD_LOCAL BoardPosition *MoveGenerator::pos;
+THREAD_LOCAL Move *MoveGenerator::moves;
+THREAD_LOCAL PackedMove *MoveGenerator::packedMoves;
+THREAD_LOCAL uint32 MoveGenerator::nMoves;
+THREAD_LOCAL uint32 MoveGenerator::chance;
+THREAD_LOCAL uint32 MoveGenerator::kingPos;
+THREAD_LOCAL uint32 MoveGenerator::childMovesBound;
+THREAD_LOCAL uint32 MoveGenerator::stageMask = ALL_STAGES;
+
+// pawn: push, double push and two captures (promoting pawns are handled seperately)
+// king: 8 normal moves + 2 castlings
+const uint32 MoveGenerator::pieceMovesBound[8] = {0, MAX_PAWN_MOVES, 8, 13, 14, 27, 10, 0};
+
+
+// staged move generation
+void StagedMoveGenerator::init(BoardPosition *position)
+{
+    pos = position;
+    stage = STAGE_CAPTURES;
+    nMoves = MoveGenerator::generateMoves(pos, moves, STAGE_CAPTURES);
+    current = 0;
+}
+
+bool StagedMoveGenerator::nextMove(Move *move)
+{
+    // current stage exhausted, generate the next one (skipping empty stages)
+    while (current == nMoves)
+    {
+        if (stage == STAGE_CASTLES)
+            return false;
+
+        stage++;
+        nMoves = MoveGenerator::generateMoves(pos, moves, stage);
+        current = 0;
+    }
+
+    *move = moves[current++];
+    return true;
+}
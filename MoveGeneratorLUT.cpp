@@ -3,178 +3,81 @@
 // generates sliding moves using a lookup table (only for bishop, rook and queen)
 // moves for other pieces are generated using the 088 move generator
 
-MoveLUTItem MoveGeneratorLUT::slidingMoveTable[1456+896+560];	 // for queen, rook and bishop
-uint32      MoveGeneratorLUT::slidingModeStart[3][64];			 // start indices from all board positions for all sliding pieces
-
-
-// adds the temp. moves generated by 088 MoveGenerator to the lookup table
-void MoveGeneratorLUT::addGeneratedMoves(uint32 &lutIndex, uint32 next1)
+// lookup tables for sliding moves, built by the compiler (read-only data, nothing is computed at startup)
+//
+// for every piece and square, the moves on an empty board, ray by ray (nearest square first)
+// next0: next entry (the next square of the ray, or the first square of the next ray)
+// next1: first square of the next ray (when the square is occupied), 0 at the end of the list
+struct SlidingMoveLUT
 {
-	uint32 n = MoveGenerator::nMoves;
-	next1 = lutIndex + n;
-	for (uint32 j=0; j < n; j++)
-	{
-		slidingMoveTable[lutIndex].tosq  = MoveGenerator::moves[j].dst;
-		slidingMoveTable[lutIndex].next0 = lutIndex + 1;
-		slidingMoveTable[lutIndex].next1 = next1;
-		lutIndex++;
-	}
-	assert((lutIndex == next1));
-	MoveGenerator::nMoves = 0;
-}
-
-// initialize the look up tables used for table driven sliding move generation
-void MoveGeneratorLUT::init()
-{
-	uint32 lutIndex = 0;
-
-	BoardPosition pos;
-	pos.chance = 0;
-	Move tempMoves[MAX_SINGLE_PIECE_MOVES];
-
-	// initialize the 088 MoveGenerator to help generating the look up table
+	MoveLUTItem moveTable[1456+896+560];	// for queen, rook and bishop
+	uint32      modeStart[3][64];			// start indices from all board positions for all sliding pieces
 
-	MoveGenerator::pos = &pos;
-	MoveGenerator::chance = 0;
-	MoveGenerator::moves = tempMoves;
-	MoveGenerator::nMoves = 0;
-
-	// 1. bishop moves
-	for (uint32 i=0; i < 64; i++)
+	// adds the moves of the ray from the (0x88) square, returns the no of moves added
+	constexpr uint32 addRay(uint32 &lutIndex, uint32 curPos, int direction)
 	{
-		uint32 rank = i / 8;
-		uint32 file = i % 8;
-		slidingModeStart[SLIDING_PIECE_INDEX(BISHOP)][i] = lutIndex;
-
-
-		// clear the board and place a single piece on it at the location 'i'
-		Utils::clearBoard(&pos);
-		uint32 curPos = INDEX088(rank, file);
-		pos.board[curPos] = COLOR_PIECE(WHITE, BISHOP);
-
-		uint32 overWriteNext1FromHere = lutIndex;
-
-		MoveGenerator::generateSlidingMoves(curPos,   0xf);    // north-west
-		addGeneratedMoves(lutIndex, 0);
-
-		MoveGenerator::generateSlidingMoves(curPos,  0x11);    // north-east
-		if (MoveGenerator::nMoves) overWriteNext1FromHere = lutIndex;
-		addGeneratedMoves(lutIndex, 0);
-
-		MoveGenerator::generateSlidingMoves(curPos,  -0x11);   // south-west
-		if (MoveGenerator::nMoves) overWriteNext1FromHere = lutIndex;
-		addGeneratedMoves(lutIndex, 0);
-
-		MoveGenerator::generateSlidingMoves(curPos,  -0xf);    // south-east
-		if (MoveGenerator::nMoves) overWriteNext1FromHere = lutIndex;
-		addGeneratedMoves(lutIndex, 0);
-
-		for(uint32 j = overWriteNext1FromHere; j<lutIndex; j++) 
-			slidingMoveTable[j].next1 = 0;
-
-		slidingMoveTable[lutIndex - 1].next0 = 0;
+		uint32 start = lutIndex;
+		uint32 n = 0;
+		for (uint32 dst = curPos + direction; ISVALIDPOS(dst); dst += direction)
+			n++;
+
+		for (uint32 dst = curPos + direction; ISVALIDPOS(dst); dst += direction)
+		{
+			moveTable[lutIndex].tosq  = dst;
+			moveTable[lutIndex].next0 = lutIndex + 1;
+			moveTable[lutIndex].next1 = start + n;
+			lutIndex++;
+		}
+		return n;
 	}
 
-	// 2. rook moves
-	for (uint32 i=0; i < 64; i++)
+	constexpr void addPiece(uint32 &lutIndex, uint32 piece, const int directions[], uint32 nDirections)
 	{
-		uint32 rank = i / 8;
-		uint32 file = i % 8;
-		slidingModeStart[SLIDING_PIECE_INDEX(ROOK)][i] = lutIndex;
-		
-		// clear the board and place a single piece on it at the location 'i'
-		Utils::clearBoard(&pos);
-		
-		uint32 curPos = INDEX088(rank, file);
-		pos.board[curPos] = COLOR_PIECE(WHITE, ROOK);
-
-		uint32 overWriteNext1FromHere = lutIndex;
-
-		MoveGenerator::generateSlidingMoves(curPos,  0x10);    // up
-		addGeneratedMoves(lutIndex, 0);
-
-		MoveGenerator::generateSlidingMoves(curPos, -0x10);    // down
-		if (MoveGenerator::nMoves) overWriteNext1FromHere = lutIndex;
-		addGeneratedMoves(lutIndex, 0);
-
-		MoveGenerator::generateSlidingMoves(curPos,   0x1);    // right
-		if (MoveGenerator::nMoves) overWriteNext1FromHere = lutIndex;
-		addGeneratedMoves(lutIndex, 0);
-
-		MoveGenerator::generateSlidingMoves(curPos,  -0x1);    // left
-		if (MoveGenerator::nMoves) overWriteNext1FromHere = lutIndex;
-		addGeneratedMoves(lutIndex, 0);
-
-		for(uint32 j = overWriteNext1FromHere; j<lutIndex; j++) 
-			slidingMoveTable[j].next1 = 0;
-
-		slidingMoveTable[lutIndex - 1].next0 = 0;
+		for (uint32 i = 0; i < 64; i++)
+		{
+			modeStart[SLIDING_PIECE_INDEX(piece)][i] = lutIndex;
+
+			uint32 curPos = INDEX088(i / 8, i % 8);
+			uint32 lastRay = lutIndex;
+			for (uint32 d = 0; d < nDirections; d++)
+			{
+				uint32 rayStart = lutIndex;
+				if (addRay(lutIndex, curPos, directions[d]))
+					lastRay = rayStart;
+			}
+
+			// after the last ray there is nothing to jump to
+			for (uint32 j = lastRay; j < lutIndex; j++)
+				moveTable[j].next1 = 0;
+
+			moveTable[lutIndex - 1].next0 = 0;
+		}
 	}
 
-	// 3. queen moves
-	for (uint32 i=0; i < 64; i++)
+	constexpr SlidingMoveLUT() : moveTable(), modeStart()
 	{
-		uint32 rank = i / 8;
-		uint32 file = i % 8;
-		slidingModeStart[SLIDING_PIECE_INDEX(QUEEN)][i] = lutIndex;
-		
-		// clear the board and place a single piece on it at the location 'i'
-		Utils::clearBoard(&pos);
-		
-		uint32 curPos = INDEX088(rank, file);
-		pos.board[curPos] = COLOR_PIECE(WHITE, QUEEN);
-
-		uint32 overWriteNext1FromHere = lutIndex;
-
-		MoveGenerator::generateSlidingMoves(curPos,  0x10);    // up
-		addGeneratedMoves(lutIndex, 0);
-
-		MoveGenerator::generateSlidingMoves(curPos, -0x10);    // down
-		if (MoveGenerator::nMoves) overWriteNext1FromHere = lutIndex;
-		addGeneratedMoves(lutIndex, 0);
-
-		MoveGenerator::generateSlidingMoves(curPos,   0x1);    // right
-		if (MoveGenerator::nMoves) overWriteNext1FromHere = lutIndex;
-		addGeneratedMoves(lutIndex, 0);
-
-		MoveGenerator::generateSlidingMoves(curPos,  -0x1);    // left
-		if (MoveGenerator::nMoves) overWriteNext1FromHere = lutIndex;
-		addGeneratedMoves(lutIndex, 0);
-
-		MoveGenerator::generateSlidingMoves(curPos,   0xf);    // north-west
-		if (MoveGenerator::nMoves) overWriteNext1FromHere = lutIndex;
-		addGeneratedMoves(lutIndex, 0);
-
-		MoveGenerator::generateSlidingMoves(curPos,  0x11);    // north-east
-		if (MoveGenerator::nMoves) overWriteNext1FromHere = lutIndex;
-		addGeneratedMoves(lutIndex, 0);
-
-		MoveGenerator::generateSlidingMoves(curPos,  -0x11);   // south-west
-		if (MoveGenerator::nMoves) overWriteNext1FromHere = lutIndex;
-		addGeneratedMoves(lutIndex, 0);
-
-		MoveGenerator::generateSlidingMoves(curPos,  -0xf);    // south-east
-		if (MoveGenerator::nMoves) overWriteNext1FromHere = lutIndex;
-		addGeneratedMoves(lutIndex, 0);
-
-		for(uint32 j = overWriteNext1FromHere; j<lutIndex; j++) 
-			slidingMoveTable[j].next1 = 0;
-
-		slidingMoveTable[lutIndex - 1].next0 = 0;
+		const int bishopDirections[] = { 0xf, 0x11, -0x11, -0xf };                           // NW, NE, SW, SE
+		const int rookDirections[]   = { 0x10, -0x10, 0x1, -0x1 };                          // up, down, right, left
+		const int queenDirections[]  = { 0x10, -0x10, 0x1, -0x1, 0xf, 0x11, -0x11, -0xf };
+
+		uint32 lutIndex = 0;
+		addPiece(lutIndex, BISHOP, bishopDirections, 4);
+		addPiece(lutIndex, ROOK,   rookDirections,   4);
+		addPiece(lutIndex, QUEEN,  queenDirections,  8);
 	}
+};
 
-	//printf("lutIndex is now: %d\n", lutIndex);
-}
+static constexpr SlidingMoveLUT slidingLUT;
 
 #if 0
 void MoveGeneratorLUT::generateSlidingMoves(uint32 origPiece, uint32 index88, uint32 index)
 {
 	uint32 side2moveBit = chance + 1;
-	uint32 *table = (uint32 *) slidingMoveTable;
+	const uint32 *table = (const uint32 *) slidingLUT.moveTable;
 
 	// taken from http://chessprogramming.wikispaces.com/Table-driven+Move+Generation
 	uint32 slidingPiece = SLIDING_PIECE_INDEX(origPiece);
-	uint32 node = slidingModeStart[slidingPiece][index];
+	uint32 node = slidingLUT.modeStart[slidingPiece][index];
 
 	do {
 		node  = table[node];
@@ -201,17 +104,26 @@ void MoveGeneratorLUT::generateSlidingMoves(uint32 origPiece, uint32 index88, ui
 
 	// taken from http://chessprogramming.wikispaces.com/Table-driven+Move+Generation
 	uint32 slidingPiece = SLIDING_PIECE_INDEX(origPiece);
-	uint32 lutIndex = slidingModeStart[slidingPiece][index];
+	uint32 lutIndex = slidingLUT.modeStart[slidingPiece][index];
 
 	do {
-		MoveLUTItem node  = slidingMoveTable[lutIndex];
+		MoveLUTItem node  = slidingLUT.moveTable[lutIndex];
 		uint32 tosq  = node.tosq;
 		uint32 piece = pos->board[tosq];
 		
-		moves[nMoves].capturedPiece = piece;
-		moves[nMoves].dst = tosq;
-		moves[nMoves].flags = 0;
-		moves[nMoves].src = index88;
+		if (packedMoves)
+		{
+			packedMoves[nMoves].dst = INDEX64(tosq);
+			packedMoves[nMoves].flags = 0;
+			packedMoves[nMoves].src = index;
+		}
+		else
+		{
+			moves[nMoves].capturedPiece = piece;
+			moves[nMoves].dst = tosq;
+			moves[nMoves].flags = 0;
+			moves[nMoves].src = index88;
+		}
 		
 		nMoves += (piece & side2moveBit) == 0;		// add the move only if it was empty or opponent square
 
@@ -220,12 +132,14 @@ void MoveGeneratorLUT::generateSlidingMoves(uint32 origPiece, uint32 index88, ui
 	while (lutIndex);
 }
 
-int MoveGeneratorLUT::generateMoves (BoardPosition *position, Move *generatedMoves)
+void MoveGeneratorLUT::generateAllMoves(BoardPosition *position)
 {
     pos = position;
-    moves = generatedMoves;
     nMoves = 0;
     chance = pos->chance;
+    childMovesBound = 0;
+
+    uint32 opponentPromotionRank = chance ? 6 : 1;
 
 	// still uses code from 0x88 move generator
 	// for non-sliding pieces
@@ -263,18 +177,44 @@ int MoveGeneratorLUT::generateMoves (BoardPosition *position, Move *generatedMov
 						break;
 				}
             }
+            else
+            {
+                // same as in MoveGenerator::generateAllMoves
+                uint32 bound = MoveGenerator::pieceMovesBound[PIECE(colorpiece)];
+                if ((PIECE(colorpiece) == PAWN) && (i == opponentPromotionRank))
+                    bound = MAX_PROMOTING_PAWN_MOVES;
+                childMovesBound += bound;
+            }
         }
     }
+}
+
+int MoveGeneratorLUT::generateMoves (BoardPosition *position, Move *generatedMoves)
+{
+    moves = generatedMoves;
+    packedMoves = NULL;
+    generateAllMoves(position);
+
+    return nMoves;
+}
+
+int MoveGeneratorLUT::generateMoves (BoardPosition *position, PackedMove *generatedMoves, uint32 *childBound)
+{
+    packedMoves = generatedMoves;
+    generateAllMoves(position);
+    *childBound = childMovesBound;
 
     return nMoves;
 }
 
 
 // static members have to be defined seperately.. what the crap! ?
-BoardPosition *MoveGeneratorLUT::pos;
-Move *MoveGeneratorLUT::moves;
-uint32 MoveGeneratorLUT::nMoves;
-uint32 MoveGeneratorLUT::chance;
+THREAD_LOCAL BoardPosition *MoveGeneratorLUT::pos;
+THREAD_LOCAL Move *MoveGeneratorLUT::moves;
+THREAD_LOCAL PackedMove *MoveGeneratorLUT::packedMoves;
+THREAD_LOCAL uint32 MoveGeneratorLUT::nMoves;
+THREAD_LOCAL uint32 MoveGeneratorLUT::chance;
+THREAD_LOCAL uint32 MoveGeneratorLUT::childMovesBound;
 
 
 
@@ -282,10 +222,19 @@ uint32 MoveGeneratorLUT::chance;
 
 void MoveGeneratorLUT::addMove(uint32 src, uint32 dst, uint8 oldPiece, uint8 flags)
 {
-    moves[nMoves].src = (uint8) src;
-    moves[nMoves].dst = (uint8) dst;
-    moves[nMoves].capturedPiece = (uint8) oldPiece;
-    moves[nMoves].flags = flags;
+    if (packedMoves)
+    {
+        packedMoves[nMoves].src   = INDEX64(src);
+        packedMoves[nMoves].dst   = INDEX64(dst);
+        packedMoves[nMoves].flags = flags;
+    }
+    else
+    {
+        moves[nMoves].src = (uint8) src;
+        moves[nMoves].dst = (uint8) dst;
+        moves[nMoves].capturedPiece = (uint8) oldPiece;
+        moves[nMoves].flags = flags;
+    }
     nMoves++;
 }
 
@@ -369,7 +318,7 @@ void MoveGeneratorLUT::generatePawnMoves(uint32 curPos)
     {
         uint32 enPassentFile = pos->enPassent - 1;
         uint32 enPassentRank = chance ? 4 : 3;
-        if ((curRank == enPassentRank) && (abs(FILE(curPos) - enPassentFile) == 1))
+        if ((curRank == enPassentRank) && (abs((int) FILE(curPos) - (int) enPassentFile) == 1))
         {
             uint32 finalRank = chance ? 5 : 2;
             newPos = INDEX088(finalRank, enPassentFile);
@@ -399,14 +348,14 @@ void MoveGeneratorLUT::generateOffsetedMoves(uint32 curPos, const uint32 jumpTab
 
 void MoveGeneratorLUT::generateKnightMoves(uint32 curPos)
 {
-    const uint32 jumpTable[] = {0x1F, 0x21, 0xE, 0x12, -0x12, -0xE, -0x21, -0x1F};
+    const uint32 jumpTable[] = {0x1F, 0x21, 0xE, 0x12, (uint32) -0x12, (uint32) -0xE, (uint32) -0x21, (uint32) -0x1F};
     generateOffsetedMoves(curPos, jumpTable, 8);
 }
 
 void MoveGeneratorLUT::generateKingMoves(uint32 curPos)
 {
     // normal moves
-    const uint32 jumpTable[] = {0xF, 0x10, 0x11, 0x1, -0x1, -0x11, -0x10, -0xF};
+    const uint32 jumpTable[] = {0xF, 0x10, 0x11, 0x1, (uint32) -0x1, (uint32) -0x11, (uint32) -0x10, (uint32) -0xF};
     generateOffsetedMoves(curPos, jumpTable, 8);
 
     // castling
@@ -0,0 +1,148 @@
+// NUMA topology, thread placement and memory placement
+#include "chess.h"
+
+#ifndef _WIN32
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+// from numaif.h (the system call is used directly so that libnuma isn't needed)
+#define MPOL_BIND           2
+#define MPOL_INTERLEAVE     3
+#define MPOL_MF_MOVE        (1 << 1)
+#endif
+
+// Worker thread i is placed on node i % nNodes, on the cpus of the node in turn, so that the threads
+// are spread evenly over the nodes. Memory shared by all the threads (the hash table) is interleaved
+// over the nodes, or partitioned: each node gets its own table in local memory (see PerftHashTable), and
+// ParallelPerft gives every node its own queue of tasks, so that a node's threads look up their own subtrees.
+
+bool   Numa::enabled;
+bool   Numa::partitioned;
+uint32 Numa::nNodes = 1;
+uint32 Numa::nodeCpuCount[MAX_NUMA_NODES];
+uint32 Numa::nodeCpus[MAX_NUMA_NODES][MAX_NUMA_CPUS];
+uint32 Numa::nodeIds[MAX_NUMA_NODES];
+
+// parses a sysfs cpu list, e.g. "0-15,32-47"
+static uint32 parseCpuList(const char *list, uint32 *cpus, uint32 maxCpus)
+{
+    uint32 n = 0;
+    while (*list && *list != '\n')
+    {
+        char *end;
+        uint32 first = strtoul(list, &end, 10), last = first;
+        if (end == list)
+            break;
+        if (*end == '-')
+            last = strtoul(end + 1, &end, 10);
+
+        for (uint32 cpu = first; cpu <= last && n < maxCpus; cpu++)
+            cpus[n++] = cpu;
+
+        list = (*end == ',') ? end + 1 : end;
+    }
+    return n;
+}
+
+void Numa::init(uint32 maxNodes)
+{
+    enabled = true;
+    nNodes = 0;
+
+#ifndef _WIN32
+    for (uint32 node = 0; node < 1024 && nNodes < MAX_NUMA_NODES && nNodes < maxNodes; node++)
+    {
+        char filename[128], list[4096];
+        sprintf(filename, "/sys/devices/system/node/node%u/cpulist", node);
+        FILE *fp = fopen(filename, "r");
+        if (!fp)
+            continue;
+        bool ok = fgets(list, sizeof(list), fp) != NULL;
+        fclose(fp);
+
+        uint32 nCpus = ok ? parseCpuList(list, nodeCpus[nNodes], MAX_NUMA_CPUS) : 0;
+        if (nCpus == 0)
+            continue;   // memory only node
+
+        nodeIds[nNodes] = node;
+        nodeCpuCount[nNodes] = nCpus;
+        nNodes++;
+    }
+#endif
+
+    if (nNodes == 0)
+    {
+        // no topology information: one node with all the cpus
+        nNodes = 1;
+        nodeIds[0] = 0;
+        nodeCpuCount[0] = ParallelPerft::threadCount() < MAX_NUMA_CPUS ? ParallelPerft::threadCount() : MAX_NUMA_CPUS;
+        for (uint32 i = 0; i < nodeCpuCount[0]; i++)
+            nodeCpus[0][i] = i;
+    }
+
+    printf("NUMA: %u node(s) used:", nNodes);
+    for (uint32 i = 0; i < nNodes; i++)
+        printf(" node %u (%u cpus)", nodeIds[i], nodeCpuCount[i]);
+    printf("\n");
+}
+
+uint32 Numa::threadNode(uint32 thread)
+{
+    return thread % nNodes;
+}
+
+void Numa::pinThread(uint32 thread)
+{
+    if (!enabled)
+        return;
+
+    uint32 node = threadNode(thread);
+    uint32 cpu = nodeCpus[node][(thread / nNodes) % nodeCpuCount[node]];
+
+#ifdef _WIN32
+    if (cpu < 64)
+        SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR) 1 << cpu);
+#else
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    sched_setaffinity(0, sizeof(set), &set);
+#endif
+}
+
+#ifndef _WIN32
+// sets the memory policy of the pages in the range (the range is extended to whole pages)
+static void setPolicy(void *ptr, uint64 size, int mode, uint64 *nodeMask)
+{
+    uint64 pageSize = sysconf(_SC_PAGESIZE);
+    uint64 start = (uint64) ptr & ~(pageSize - 1);
+    uint64 end = ((uint64) ptr + size + pageSize - 1) & ~(pageSize - 1);
+    syscall(SYS_mbind, start, end - start, mode, nodeMask, (unsigned long) 1024, MPOL_MF_MOVE);
+}
+#endif
+
+void Numa::interleave(void *ptr, uint64 size)
+{
+#ifndef _WIN32
+    if (!enabled || nNodes < 2)
+        return;
+
+    uint64 nodeMask[16] = { 0 };
+    for (uint32 i = 0; i < nNodes; i++)
+        nodeMask[nodeIds[i] / 64] |= 1ULL << (nodeIds[i] % 64);
+    setPolicy(ptr, size, MPOL_INTERLEAVE, nodeMask);
+#endif
+}
+
+void Numa::bindToNode(void *ptr, uint64 size, uint32 node)
+{
+#ifndef _WIN32
+    if (!enabled || nNodes < 2)
+        return;
+
+    uint64 nodeMask[16] = { 0 };
+    nodeMask[nodeIds[node] / 64] |= 1ULL << (nodeIds[node] % 64);
+    setPolicy(ptr, size, MPOL_BIND, nodeMask);
+#endif
+}
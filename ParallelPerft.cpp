@@ -0,0 +1,376 @@
+// perft of many positions on multiple threads
+#include "chess.h"
+#include <thread>
+#include <atomic>
+#include <vector>
+#include <algorithm>
+#include <math.h>
+
+// Scheduling: the work items are turned into tasks with an estimated cost (no of leaf nodes, from a
+// shallow perft extrapolated with the branching factor of the position). Tasks much bigger than a
+// thread's share of the work are split into their children, and the tasks are handed out in order of
+// decreasing cost (longest processing time first), so that the last tasks to finish are small ones.
+
+// cheap tasks are handed out a few at a time
+#define TASKS_PER_FETCH     16
+
+// tasks are split till none is bigger than 1/SPLIT_FACTOR of a thread's share of the work
+#define SPLIT_FACTOR        8
+#define MAX_TASKS_PER_THREAD 256
+
+// costs are estimated only for tasks with at least this depth (smaller ones are cheap)
+#define MIN_ESTIMATE_DEPTH  3
+
+uint32 ParallelPerft::nThreads = 0;
+uint32 ParallelPerft::walkersPerThread = 1;
+
+struct PerftTask
+{
+    BoardPosition pos;
+    uint64 count;
+    double cost;            // estimated no of leaf nodes
+    uint64 item;            // index of the work item the task belongs to
+    int    depth;
+    uint32 node;            // queue of the task (NUMA node, see TaskQueue)
+};
+
+struct ThreadStats
+{
+    uint64 tasks;
+    double busyTime;        // seconds
+    double idleTime;        // seconds the thread was waiting for others to finish
+};
+
+static std::vector<ThreadStats> threadStats;
+
+uint32 ParallelPerft::threadCount()
+{
+    if (nThreads)
+        return nThreads;
+
+    uint32 n = std::thread::hardware_concurrency();
+    return n ? n : 1;
+}
+
+static double secondsSince(std::chrono::high_resolution_clock::time_point start)
+{
+    return std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+}
+
+// estimated no of leaf nodes of perft(depth): perft of 2 plies (1 for small depths) extrapolated with
+// the branching factor of the position
+// 0 if there are no leaves (mate or stalemate on the way): such tasks are never split
+static double estimateCost(BoardPosition *pos, int depth)
+{
+    uint64 counts[3];
+    int shallow = depth >= 4 ? 2 : 1;
+    perftAllDepths<MoveGenerator>(pos, shallow, counts);
+    if (counts[shallow] == 0)
+        return 0;
+
+    double branching = (double) counts[shallow] / counts[shallow - 1];
+    return counts[shallow] * pow(branching, depth - shallow);
+}
+
+static bool costMore(const PerftTask &a, const PerftTask &b)
+{
+    return a.cost > b.cost;
+}
+
+static bool costLess(const PerftTask &a, const PerftTask &b)
+{
+    return a.cost < b.cost;
+}
+
+// splits the biggest tasks into their children (one ply less deep)
+static void splitTasks(std::vector<PerftTask> &tasks, uint32 nThreads)
+{
+    double totalCost = 0;
+    for (size_t i = 0; i < tasks.size(); i++)
+        totalCost += tasks[i].cost;
+
+    double maxCost = totalCost / (nThreads * SPLIT_FACTOR);
+    size_t maxTasks = (size_t) nThreads * MAX_TASKS_PER_THREAD;
+
+    // max-heap by cost: split the biggest till it's small enough
+    std::make_heap(tasks.begin(), tasks.end(), costLess);
+    while (!tasks.empty() && tasks.size() < maxTasks && tasks.front().cost > maxCost &&
+           tasks.front().depth > MIN_ESTIMATE_DEPTH)
+    {
+        std::pop_heap(tasks.begin(), tasks.end(), costLess);
+        PerftTask parent = tasks.back();
+        tasks.pop_back();
+
+        PackedMove moves[MAX_MOVES];
+        uint32 childBound;
+        uint32 nMoves = MoveGenerator::generateMoves(&parent.pos, moves, &childBound);
+        for (uint32 i = 0; i < nMoves; i++)
+        {
+            PerftTask child = parent;
+            makeMove(&child.pos, moves[i]);
+            child.depth = parent.depth - 1;
+            child.cost = estimateCost(&child.pos, child.depth);
+            tasks.push_back(child);
+            std::push_heap(tasks.begin(), tasks.end(), costLess);
+        }
+    }
+}
+
+static uint64 runTask(PerftTask *task, bool hashed)
+{
+    if (hashed)
+        return perftHashed<MoveGenerator>(&task->pos, task->depth);
+    else
+        return perft<MoveGenerator>(&task->pos, task->depth);
+}
+
+// tasks are taken from queues: a single one, or with a hash table partition for every NUMA node
+// (Numa::partitioned) one queue per node, so that a node's threads work on the subtrees of its own tasks
+// against its own partition; a thread takes tasks of another node only when its node's queue is empty
+struct TaskQueue
+{
+    std::atomic<uint64> next;       // index of the next task to take
+    uint64 end;
+};
+
+struct WorkerContext
+{
+    PerftTask *tasks;
+    TaskQueue *queues;
+    uint32     nQueues;
+    bool       hashed;
+    uint32     fetchSize;
+};
+
+// takes up to fetchSize tasks [first, last), from the queue of the thread's node first
+static bool takeTasks(const WorkerContext *context, uint32 thread, uint32 fetchSize, uint64 *first, uint64 *last)
+{
+    uint32 home = Numa::threadNode(thread) % context->nQueues;
+    for (uint32 q = 0; q < context->nQueues; q++)
+    {
+        TaskQueue *queue = &context->queues[(home + q) % context->nQueues];
+        if (queue->next.load(std::memory_order_relaxed) >= queue->end)
+            continue;
+
+        uint64 index = queue->next.fetch_add(fetchSize);
+        if (index >= queue->end)
+            continue;
+
+        *first = index;
+        *last = index + fetchSize < queue->end ? index + fetchSize : queue->end;
+        return true;
+    }
+    return false;
+}
+
+// takes tasks from the queues till all are done
+static void worker(uint32 thread, const WorkerContext *context, ThreadStats *stats, uint64 *probes, uint64 *hits)
+{
+    std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+
+    uint64 first, last;
+    while (takeTasks(context, thread, context->fetchSize, &first, &last))
+    {
+        for (uint64 i = first; i < last; i++)
+            context->tasks[i].count = runTask(&context->tasks[i], context->hashed);
+        stats->tasks += last - first;
+    }
+
+    stats->busyTime += secondsSince(start);
+
+    // hash table statistics are per thread
+    *probes = PerftHashTable::probes;
+    *hits = PerftHashTable::hits;
+}
+
+// hashed perft with several walkers on the thread: each walker takes a task, and the walkers are stepped
+// in turn (a walker stops after prefetching a hash table bucket, so the others run while it's loaded)
+// walkers are always hashed, and take one task at a time
+static void interleavedWorker(uint32 thread, const WorkerContext *context, ThreadStats *stats, uint64 *probes,
+                              uint64 *hits)
+{
+    std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+
+    uint32 nWalkers = ParallelPerft::walkersPerThread;
+    std::vector<PerftWalker> walkers(nWalkers);
+    std::vector<uint64> walkerTask(nWalkers);
+    std::vector<bool> active(nWalkers);
+    PerftTask *tasks = context->tasks;
+
+    uint32 nActive = 0;
+    for (uint32 w = 0; w < nWalkers; w++)
+    {
+        uint64 last;
+        active[w] = takeTasks(context, thread, 1, &walkerTask[w], &last);
+        if (active[w])
+        {
+            walkers[w].start(&tasks[walkerTask[w]].pos, tasks[walkerTask[w]].depth);
+            nActive++;
+        }
+    }
+
+    while (nActive)
+    {
+        for (uint32 w = 0; w < nWalkers; w++)
+        {
+            if (!active[w] || walkers[w].step())
+                continue;
+
+            // done with the task, take the next one
+            tasks[walkerTask[w]].count = walkers[w].count();
+            stats->tasks++;
+            uint64 last;
+            active[w] = takeTasks(context, thread, 1, &walkerTask[w], &last);
+            if (active[w])
+                walkers[w].start(&tasks[walkerTask[w]].pos, tasks[walkerTask[w]].depth);
+            else
+                nActive--;
+        }
+    }
+
+    stats->busyTime += secondsSince(start);
+
+    *probes = PerftHashTable::probes;
+    *hits = PerftHashTable::hits;
+}
+
+// entry of the threads started by ParallelPerft: only these are pinned (see Numa::pinThread)
+static void workerThread(uint32 thread, const WorkerContext *context, bool interleaved, ThreadStats *stats,
+                         uint64 *probes, uint64 *hits)
+{
+    Numa::pinThread(thread);
+    PerftHashTable::selectPartition(Numa::threadNode(thread));
+
+    if (interleaved)
+        interleavedWorker(thread, context, stats, probes, hits);
+    else
+        worker(thread, context, stats, probes, hits);
+}
+
+static bool nodeLess(const PerftTask &a, const PerftTask &b)
+{
+    return a.node < b.node;
+}
+
+uint64 ParallelPerft::run(PerftWorkItem *items, uint64 nItems, int depth, bool hashed)
+{
+    std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+
+    uint32 n = threadCount();
+    if (threadStats.size() < n)
+        threadStats.resize(n);
+
+    std::vector<PerftTask> tasks((size_t) nItems);
+    for (uint64 i = 0; i < nItems; i++)
+    {
+        tasks[i].pos = items[i].pos;
+        tasks[i].count = 0;
+        tasks[i].cost = 1;
+        tasks[i].item = i;
+        tasks[i].depth = depth;
+        tasks[i].node = 0;
+    }
+
+    // scheduling is only worth it when there are other threads (and the tasks aren't tiny)
+    uint32 fetchSize = TASKS_PER_FETCH;
+    if (n > 1 && depth >= MIN_ESTIMATE_DEPTH)
+    {
+        for (size_t i = 0; i < tasks.size(); i++)
+            tasks[i].cost = estimateCost(&tasks[i].pos, depth);
+
+        splitTasks(tasks, n);
+        std::sort(tasks.begin(), tasks.end(), costMore);
+        fetchSize = 1;
+    }
+
+    uint64 nTasks = tasks.size();
+
+    if (n > (nTasks + fetchSize - 1) / fetchSize)
+        n = (uint32) ((nTasks + fetchSize - 1) / fetchSize);
+
+    // a queue per node with partitioned hash tables: tasks go to the node of their position's hash (so the
+    // same position always goes to the same node), in the order of decreasing cost within each queue
+    uint32 nQueues = (hashed && Numa::partitioned && n > 1) ? Numa::nNodes : 1;
+    if (nQueues > 1)
+    {
+        for (size_t i = 0; i < tasks.size(); i++)
+            tasks[i].node = (uint32) (Zobrist::computeHash(&tasks[i].pos) % nQueues);
+        std::stable_sort(tasks.begin(), tasks.end(), nodeLess);
+    }
+
+    std::vector<TaskQueue> queues(nQueues);
+    for (uint32 q = 0, i = 0; q < nQueues; q++)
+    {
+        queues[q].next = i;
+        while (i < nTasks && tasks[i].node == q)
+            i++;
+        queues[q].end = i;
+    }
+
+    WorkerContext context;
+    context.tasks = nTasks ? &tasks[0] : NULL;
+    context.queues = &queues[0];
+    context.nQueues = nQueues;
+    context.hashed = hashed;
+    context.fetchSize = fetchSize;
+
+    bool interleaved = hashed && walkersPerThread > 1;
+    std::vector<ThreadStats> stats(n > 1 ? n : 1);
+    memset(&stats[0], 0, stats.size() * sizeof(ThreadStats));
+
+    if (n <= 1)
+    {
+        // no need for other threads: the calling thread isn't pinned (it may be the main thread, or the job
+        // thread of the server, which run other work later), it only uses the table of the first node
+        uint64 probes = PerftHashTable::probes, hits = PerftHashTable::hits;
+        PerftHashTable::selectPartition(Numa::threadNode(0));
+        if (interleaved)
+            interleavedWorker(0, &context, &stats[0], &probes, &hits);
+        else
+            worker(0, &context, &stats[0], &probes, &hits);
+    }
+    else
+    {
+        std::vector<std::thread> threads;
+        std::vector<uint64> probes(n), hits(n);
+        for (uint32 i = 0; i < n; i++)
+            threads.push_back(std::thread(workerThread, i, &context, interleaved, &stats[i], &probes[i], &hits[i]));
+
+        for (uint32 i = 0; i < n; i++)
+        {
+            threads[i].join();
+            PerftHashTable::probes += probes[i];
+            PerftHashTable::hits += hits[i];
+        }
+    }
+
+    // idle time: the part of the run a thread wasn't working (including threads that got no task)
+    double runTime = secondsSince(start);
+    for (uint32 i = 0; i < threadStats.size(); i++)
+    {
+        ThreadStats *s = i < stats.size() ? &stats[i] : NULL;
+        threadStats[i].tasks    += s ? s->tasks : 0;
+        threadStats[i].busyTime += s ? s->busyTime : 0;
+        threadStats[i].idleTime += runTime - (s ? s->busyTime : 0);
+    }
+
+    for (uint64 i = 0; i < nItems; i++)
+        items[i].count = 0;
+    for (uint64 i = 0; i < nTasks; i++)
+        items[tasks[i].item].count += tasks[i].count;
+
+    uint64 total = 0;
+    for (uint64 i = 0; i < nItems; i++)
+        total += items[i].count * items[i].multiplicity;
+
+    return total;
+}
+
+void ParallelPerft::printThreadStats()
+{
+    for (uint32 i = 0; i < threadStats.size(); i++)
+    {
+        printf("thread %u (node %u): %llu tasks, busy %.3f s, idle %.3f s\n", i, Numa::threadNode(i),
+               threadStats[i].tasks, threadStats[i].busyTime, threadStats[i].idleTime);
+    }
+}
@@ -0,0 +1,113 @@
+// monte carlo estimation of perft
+#include "chess.h"
+#include <thread>
+#include <vector>
+#include <math.h>
+
+// A random path is played from the root, choosing uniformly among the legal moves at every ply.
+// The product of the no of moves along the path is an unbiased estimate of the no of nodes at the
+// end of the path (Knuth's estimator). To reduce the variance, only the first depth - ESTIMATE_EXACT_PLIES
+// plies are sampled: perft of the rest is computed exactly at the end of the path.
+// The mean of the samples is the estimate, its standard error gives the confidence interval.
+
+#define ESTIMATE_EXACT_PLIES    2
+#define SAMPLES_PER_TIME_CHECK  16
+
+struct SampleStats
+{
+    uint64 samples;
+    double sum;
+    double sumSquares;
+};
+
+// xorshift64*
+static uint64 random64(uint64 *state)
+{
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545F4914F6CDD1DULL;
+}
+
+// runs on each thread: takes samples till the time is up
+static void sampler(BoardPosition root, int depth, std::chrono::steady_clock::time_point deadline, uint64 seed,
+                    SampleStats *stats)
+{
+    int exactPlies = depth < ESTIMATE_EXACT_PLIES ? depth : ESTIMATE_EXACT_PLIES;
+    uint64 randomState = seed;
+
+    do
+    {
+        for (int s = 0; s < SAMPLES_PER_TIME_CHECK; s++)
+        {
+            BoardPosition pos = root;
+            double weight = 1;
+
+            for (int ply = 0; ply < depth - exactPlies; ply++)
+            {
+                PackedMove moves[MAX_MOVES];
+                uint32 childBound;
+                uint32 nMoves = MoveGenerator::generateMoves(&pos, moves, &childBound);
+                if (nMoves == 0)
+                {
+                    // the path ends early (mate or stalemate): no nodes at depth below it
+                    weight = 0;
+                    break;
+                }
+                weight *= nMoves;
+                makeMove(&pos, moves[random64(&randomState) % nMoves]);
+            }
+
+            if (weight != 0)
+                weight *= (double) perft<MoveGenerator>(&pos, exactPlies);
+
+            stats->samples++;
+            stats->sum += weight;
+            stats->sumSquares += weight * weight;
+        }
+    } while (std::chrono::steady_clock::now() < deadline);
+}
+
+PerftEstimate PerftEstimator::estimate(BoardPosition *pos, int depth, double seconds)
+{
+    std::chrono::steady_clock::time_point deadline =
+        std::chrono::steady_clock::now() + std::chrono::microseconds((uint64) (seconds * 1e6));
+
+    uint32 nThreads = ParallelPerft::threadCount();
+    std::vector<SampleStats> stats(nThreads);
+    std::vector<std::thread> threads;
+
+    // different random paths on every thread (and every run)
+    uint64 seed = (uint64) std::chrono::high_resolution_clock::now().time_since_epoch().count();
+
+    for (uint32 i = 0; i < nThreads; i++)
+    {
+        memset(&stats[i], 0, sizeof(SampleStats));
+        uint64 threadSeed = (seed + i) * 0x9E3779B97F4A7C15ULL | 1;     // xorshift state must not be zero
+        threads.push_back(std::thread(sampler, *pos, depth, deadline, threadSeed, &stats[i]));
+    }
+
+    SampleStats total = { 0, 0, 0 };
+    for (uint32 i = 0; i < nThreads; i++)
+    {
+        threads[i].join();
+        total.samples    += stats[i].samples;
+        total.sum        += stats[i].sum;
+        total.sumSquares += stats[i].sumSquares;
+    }
+
+    PerftEstimate result;
+    result.samples = total.samples;
+    result.estimate = total.sum / total.samples;
+
+    double variance = 0;
+    if (total.samples > 1)
+        variance = (total.sumSquares - total.sum * result.estimate) / (total.samples - 1);
+    if (variance < 0)
+        variance = 0;   // rounding
+
+    // 95% confidence: 1.96 standard errors
+    result.confidence = 1.96 * sqrt(variance / total.samples);
+
+    return result;
+}
@@ -0,0 +1,416 @@
+// zobrist hashing and the perft hash table
+#include "chess.h"
+#include <stddef.h>
+
+/** Zobrist hashing **/
+
+// definitions of the constexpr members (the keys are generated by the compiler, see ZobristKeys)
+constexpr ZobristKeys Zobrist::keys;
+constexpr const uint64 (&Zobrist::pieceKeys)[32][64];
+constexpr const uint64 (&Zobrist::castleKeys)[16];
+constexpr const uint64 (&Zobrist::enPassentKeys)[9];
+constexpr const uint64 &Zobrist::chanceKey;
+constexpr const uint64 (&Zobrist::depthKeys)[MAX_PERFT_DEPTH];
+constexpr const uint64 (&Zobrist::symmetricPieceKeys)[N_SYMMETRIES][32][64];
+constexpr const uint64 (&Zobrist::symmetricCastleKeys)[N_SYMMETRIES][16];
+constexpr const uint64 (&Zobrist::symmetricEnPassentKeys)[N_SYMMETRIES][9];
+bool Zobrist::useSymmetry;
+
+// offsets of the hashes of the images in BoardPosition
+static const uint32 hashOffset[N_SYMMETRIES] =
+{
+    offsetof(BoardPosition, hash),
+    offsetof(BoardPosition, flipHash),
+    offsetof(BoardPosition, mirrorHash),
+    offsetof(BoardPosition, flipMirrorHash)
+};
+
+__forceinline static uint64 *hashOfImage(BoardPosition *pos, uint32 symmetry)
+{
+    return (uint64 *) ((uint8 *) pos + hashOffset[symmetry]);
+}
+
+uint64 Zobrist::computeHash(BoardPosition *pos)
+{
+    uint64 hash = 0;
+    for (uint32 i = 0; i < 8; i++)
+        for (uint32 j = 0; j < 8; j++)
+            hash ^= pieceKeys[pos->board[INDEX088(i, j)]][i * 8 + j];
+
+    hash ^= castleKeys[CASTLE_INDEX(pos)];
+    hash ^= enPassentKeys[pos->enPassent];
+    if (pos->chance)
+        hash ^= chanceKey;
+
+    return hash;
+}
+
+__forceinline uint64 Zobrist::squareDelta(const uint64 keys[32][64], BoardPosition *pos, BoardPosition *newPos,
+                                          uint32 index088)
+{
+    uint32 index64 = INDEX64(index088);
+    return keys[pos->board[index088]][index64] ^ keys[newPos->board[index088]][index64];
+}
+
+__forceinline uint64 Zobrist::updateHash(uint64 hash, const uint64 pieceKeys[32][64], const uint64 castleKeys[16],
+                                         const uint64 enPassentKeys[9], BoardPosition *pos, BoardPosition *newPos,
+                                         PackedMove move)
+{
+    uint32 src = INDEX088_FROM64(move.src);
+    uint32 dst = INDEX088_FROM64(move.dst);
+
+    // only the squares touched by the move can change
+    hash ^= squareDelta(pieceKeys, pos, newPos, src);
+    hash ^= squareDelta(pieceKeys, pos, newPos, dst);
+
+    if (move.flags == CASTLE_KING_SIDE)
+    {
+        hash ^= squareDelta(pieceKeys, pos, newPos, src + 3);
+        hash ^= squareDelta(pieceKeys, pos, newPos, src + 1);
+    }
+    else if (move.flags == CASTLE_QUEEN_SIDE)
+    {
+        hash ^= squareDelta(pieceKeys, pos, newPos, src - 4);
+        hash ^= squareDelta(pieceKeys, pos, newPos, src - 1);
+    }
+    else if (move.flags == EN_PASSENT)
+    {
+        hash ^= squareDelta(pieceKeys, pos, newPos, INDEX088(RANK(src), FILE(dst)));
+    }
+
+    hash ^= castleKeys[CASTLE_INDEX(pos)] ^ castleKeys[CASTLE_INDEX(newPos)];
+    hash ^= enPassentKeys[pos->enPassent] ^ enPassentKeys[newPos->enPassent];
+    hash ^= chanceKey;
+
+    return hash;
+}
+
+// hash of newPos (the position after making the move on pos) - computed incrementally from pos->hash
+uint64 Zobrist::updateHash(BoardPosition *pos, BoardPosition *newPos, PackedMove move)
+{
+    return updateHash(pos->hash, pieceKeys, castleKeys, enPassentKeys, pos, newPos, move);
+}
+
+void Zobrist::computeSymmetricHashes(BoardPosition *pos)
+{
+    for (uint32 s = 1; s < N_SYMMETRIES; s++)
+    {
+        uint64 hash = 0;
+        for (uint32 i = 0; i < 64; i++)
+            hash ^= symmetricPieceKeys[s][pos->board[INDEX088_FROM64(i)]][i];
+
+        hash ^= symmetricCastleKeys[s][CASTLE_INDEX(pos)];
+        hash ^= symmetricEnPassentKeys[s][pos->enPassent];
+
+        // side to move is swapped in flipped images
+        uint32 imageChance = (s & SYMMETRY_FLIP) ? !pos->chance : pos->chance;
+        if (imageChance)
+            hash ^= chanceKey;
+
+        *hashOfImage(pos, s) = hash;
+    }
+}
+
+void Zobrist::updateSymmetricHashes(BoardPosition *pos, BoardPosition *newPos, PackedMove move)
+{
+    for (uint32 s = 1; s < N_SYMMETRIES; s++)
+    {
+        *hashOfImage(newPos, s) = updateHash(*hashOfImage(pos, s), symmetricPieceKeys[s], symmetricCastleKeys[s],
+                                             symmetricEnPassentKeys[s], pos, newPos, move);
+    }
+}
+
+uint64 Zobrist::canonicalHash(BoardPosition *pos, uint32 *symmetry)
+{
+    // left-right reflection would swap the king and queen side castles
+    uint32 nSymmetries = CASTLE_INDEX(pos) ? SYMMETRY_MIRROR : N_SYMMETRIES;
+
+    uint64 hash = pos->hash;
+    *symmetry = 0;
+    for (uint32 s = 1; s < nSymmetries; s++)
+    {
+        if (*hashOfImage(pos, s) < hash)
+        {
+            hash = *hashOfImage(pos, s);
+            *symmetry = s;
+        }
+    }
+
+    return hash;
+}
+
+
+/** perft hash table **/
+
+THREAD_LOCAL HashBucket *PerftHashTable::table;
+HashBucket *PerftHashTable::partitions[MAX_NUMA_NODES];
+uint32      PerftHashTable::nPartitions;
+uint64      PerftHashTable::partitionSize;
+uint64      PerftHashTable::mask;
+void       *PerftHashTable::mapping;
+uint64      PerftHashTable::mappingSize;
+THREAD_LOCAL uint64 PerftHashTable::probes;
+THREAD_LOCAL uint64 PerftHashTable::hits;
+
+// header of persistent hash table files
+struct HashFileHeader
+{
+    char   magic[8];        // "PERFTHT3"
+    uint32 bucketSize;
+    uint32 headerSize;
+    uint64 nBuckets;
+    uint64 keyCheck;        // zobrist hash of the starting position (to detect change in keys)
+    uint8  padding[HASH_FILE_HEADER_SIZE - 32];
+};
+CT_ASSERT(sizeof(HashFileHeader) == HASH_FILE_HEADER_SIZE);
+
+static uint64 keyCheckValue()
+{
+    BoardPosition pos;
+    Utils::readFENString("rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1", &pos);
+    return Zobrist::computeHash(&pos);
+}
+
+static const char *pageSizeString(uint64 pageSize)
+{
+    static char str[32];
+    if (pageSize >= GIANT_PAGE_SIZE)
+        sprintf(str, "%llu GB", pageSize >> 30);
+    else if (pageSize >= 1024 * 1024)
+        sprintf(str, "%llu MB", pageSize >> 20);
+    else
+        sprintf(str, "%llu KB", pageSize >> 10);
+    return str;
+}
+
+// allocates the hash table (size is rounded down to a power of 2 no of buckets)
+// if filename is given, the table is backed by (and saved in) the file,
+// and an existing file is reused along with all the counts stored in it
+bool PerftHashTable::init(uint64 sizeInMB, const char *filename)
+{
+    release();
+
+    // with NUMA partitions every node gets a table of its own (of 1/nNodes of the size) in local memory
+    nPartitions = 1;
+    if (Numa::partitioned && Numa::nNodes > 1)
+    {
+        if (filename)
+            printf("NUMA partitioned tables can't be kept in a file, using one table interleaved over the nodes\n");
+        else
+            nPartitions = Numa::nNodes;
+    }
+
+    uint64 nBuckets = 1;
+    while (nBuckets * 2 * sizeof(HashBucket) * nPartitions <= sizeInMB * 1024 * 1024)
+        nBuckets *= 2;
+
+    if (!filename)
+    {
+        uint64 pageSize = 0;
+        bool transparent = false;
+        for (uint32 i = 0; i < nPartitions; i++)
+        {
+            // the pages aren't touched yet (they are fresh pages from the OS, zero filled when first used),
+            // so the NUMA policy decides where they are allocated
+            partitionSize = nBuckets * sizeof(HashBucket);
+            partitions[i] = (HashBucket *) Memory::allocLarge(&partitionSize, &pageSize, &transparent);
+            if (!partitions[i])
+            {
+                release();
+                return false;
+            }
+
+            if (nPartitions > 1)
+                Numa::bindToNode(partitions[i], partitionSize, i);
+            else
+                Numa::interleave(partitions[i], partitionSize);
+        }
+        table = partitions[0];
+        mask = nBuckets - 1;
+
+        printf("hash table: %llu MB in %s pages%s\n", (nPartitions * nBuckets * sizeof(HashBucket)) >> 20,
+               pageSizeString(pageSize), transparent ? " (transparent)" : "");
+        return true;
+    }
+
+    // size rounded up to a multiple of 2 MB so that the file can be placed on hugetlbfs
+    uint64 size = HASH_FILE_HEADER_SIZE + nBuckets * sizeof(HashBucket);
+    size = (size + HUGE_PAGE_SIZE - 1) & ~((uint64) HUGE_PAGE_SIZE - 1);
+
+    bool created;
+    mapping = Memory::mapFile(filename, &size, &created);
+    if (!mapping)
+    {
+        printf("can't map hash file %s\n", filename);
+        return false;
+    }
+    mappingSize = size;
+
+    HashFileHeader *header = (HashFileHeader *) mapping;
+    if (created)
+    {
+        memcpy(header->magic, "PERFTHT3", 8);
+        header->bucketSize = sizeof(HashBucket);
+        header->headerSize = HASH_FILE_HEADER_SIZE;
+        header->nBuckets   = nBuckets;
+        header->keyCheck   = keyCheckValue();
+    }
+    else
+    {
+        nBuckets = header->nBuckets;
+        if (memcmp(header->magic, "PERFTHT3", 8) || header->bucketSize != sizeof(HashBucket) ||
+            header->headerSize != HASH_FILE_HEADER_SIZE || header->keyCheck != keyCheckValue() ||
+            (nBuckets & (nBuckets - 1)) || HASH_FILE_HEADER_SIZE + nBuckets * sizeof(HashBucket) > size)
+        {
+            printf("%s is not a valid hash file (or was created by an incompatible version)\n", filename);
+            release();
+            return false;
+        }
+        printf("reusing hash file %s (%llu MB)\n", filename, (nBuckets * sizeof(HashBucket)) >> 20);
+    }
+
+    Numa::interleave(mapping, mappingSize);
+
+    table = (HashBucket *) ((uint8 *) mapping + HASH_FILE_HEADER_SIZE);
+    partitions[0] = table;
+    mask = nBuckets - 1;
+    return true;
+}
+
+void PerftHashTable::release()
+{
+    if (mapping)
+    {
+        Memory::unmapFile(mapping, mappingSize);
+    }
+    else
+    {
+        for (uint32 i = 0; i < nPartitions; i++)
+            if (partitions[i])
+                Memory::freeLarge(partitions[i], partitionSize);
+    }
+
+    for (uint32 i = 0; i < MAX_NUMA_NODES; i++)
+        partitions[i] = NULL;
+
+    mapping = NULL;
+    table = NULL;
+}
+
+void PerftHashTable::clear()
+{
+    for (uint32 i = 0; i < nPartitions; i++)
+        if (partitions[i])
+            memset(partitions[i], 0, (mask + 1) * sizeof(HashBucket));
+}
+
+void PerftHashTable::selectPartition(uint32 node)
+{
+    table = partitions[nPartitions > 1 ? node % nPartitions : 0];
+}
+
+// the lower bits of the key select the bucket, the upper 40 bits are checked
+#define KEY_CHECK(key)  ((key) >> 24)
+#define DATA_MASK       ((1ULL << 40) - 1)
+#define COUNT_MASK      ((1ULL << HASH_COUNT_BITS) - 1)
+
+// the key of the second entry of a wide count (see HashBucket)
+#define HASH_WIDE_KEY   0x6A09E667F3BCC908ULL
+
+// the key check of an entry is xor-ed with the data so that entries written partially
+// (e.g. by another thread or when the run is killed) are detected as misses
+
+// index of the entry with the key check and depth (-1 if there's none), its data is set to data
+static int findEntry(HashBucket *bucket, uint64 check, uint32 depth, uint64 *data)
+{
+    for (uint32 i = 0; i < HASH_BUCKET_ENTRIES; i++)
+    {
+        *data = bucket->dataLo[i] | ((uint64) bucket->dataHi[i] << 32);
+        uint64 entryKey = bucket->keyLo[i] | ((uint64) bucket->keyHi[i] << 32);
+        if ((entryKey ^ *data) == check && (*data >> HASH_COUNT_BITS) == depth)
+            return i;
+    }
+    return -1;
+}
+
+// the entry of the same key check, or else the one with the smallest depth (empty entries have depth 0)
+// other than the entry 'exclude'
+static uint32 replacedEntry(HashBucket *bucket, uint64 check, int exclude)
+{
+    uint32 replace = 0;
+    uint32 minDepth = MAX_PERFT_DEPTH + 1;
+    for (uint32 i = 0; i < HASH_BUCKET_ENTRIES; i++)
+    {
+        if ((int) i == exclude)
+            continue;
+
+        uint64 data = bucket->dataLo[i] | ((uint64) bucket->dataHi[i] << 32);
+        uint64 entryKey = bucket->keyLo[i] | ((uint64) bucket->keyHi[i] << 32);
+        if ((entryKey ^ data) == check)
+            return i;
+
+        uint32 entryDepth = (uint32) (data >> HASH_COUNT_BITS);
+        if (entryDepth < minDepth)
+        {
+            minDepth = entryDepth;
+            replace = i;
+        }
+    }
+    return replace;
+}
+
+static void writeEntry(HashBucket *bucket, uint32 i, uint64 check, uint32 depth, uint64 countField)
+{
+    uint64 data = ((uint64) depth << HASH_COUNT_BITS) | countField;
+    uint64 entryKey = (check ^ data) & DATA_MASK;
+    bucket->keyLo[i]  = (uint32) entryKey;
+    bucket->keyHi[i]  = (uint8) (entryKey >> 32);
+    bucket->dataLo[i] = (uint32) data;
+    bucket->dataHi[i] = (uint8) (data >> 32);
+}
+
+bool PerftHashTable::probe(uint64 hash, uint32 depth, uint64 *count)
+{
+    assert(depth < MAX_PERFT_DEPTH);
+    uint64 key = hash ^ Zobrist::depthKeys[depth];
+    HashBucket *bucket = &table[key & mask];
+    probes++;
+
+    uint64 data;
+    if (findEntry(bucket, KEY_CHECK(key), depth, &data) < 0)
+        return false;
+
+    uint64 countField = data & COUNT_MASK;
+    if (countField >= HASH_WIDE_COUNT)
+    {
+        // a wide count: the second entry may have been replaced since
+        uint64 lowData;
+        if (findEntry(bucket, KEY_CHECK(key ^ HASH_WIDE_KEY), depth, &lowData) < 0)
+            return false;
+        countField = ((countField - HASH_WIDE_COUNT) << HASH_COUNT_BITS) | (lowData & COUNT_MASK);
+    }
+
+    hits++;
+    *count = countField;
+    return true;
+}
+
+void PerftHashTable::store(uint64 hash, uint32 depth, uint64 count)
+{
+    assert(depth < MAX_PERFT_DEPTH);
+    uint64 key = hash ^ Zobrist::depthKeys[depth];
+    uint64 check = KEY_CHECK(key);
+    HashBucket *bucket = &table[key & mask];
+
+    uint32 entry = replacedEntry(bucket, check, -1);
+    if (count < HASH_WIDE_COUNT)
+    {
+        writeEntry(bucket, entry, check, depth, count);
+        return;
+    }
+
+    // the lower bits are written first: the entry of the key isn't a hit without them
+    uint64 wideCheck = KEY_CHECK(key ^ HASH_WIDE_KEY);
+    writeEntry(bucket, replacedEntry(bucket, wideCheck, entry), wideCheck, depth, count & COUNT_MASK);
+    writeEntry(bucket, entry, check, depth, HASH_WIDE_COUNT | (count >> HASH_COUNT_BITS));
+}
@@ -0,0 +1,234 @@
+// resumable perft: progress is recorded in an append-only journal file
+#include "chess.h"
+
+#ifdef _WIN32
+#include <io.h>
+#define fsync _commit
+
+static int truncate(const char *filename, long length)
+{
+    FILE *fp = fopen(filename, "r+");
+    if (!fp)
+        return -1;
+    int ret = _chsize(_fileno(fp), length);
+    fclose(fp);
+    return ret;
+}
+#else
+#include <unistd.h>
+#endif
+
+/*
+  Format of the journal (text file, one record per line):
+
+  perft <depth> <fen>           - header: the run the journal belongs to
+  <move1> <move2> <count>       - perft of the subtree after root move 'move1' and reply 'move2'
+  <move1> <count>               - perft of the subtree after root move 'move1' (written after all its replies)
+
+  moves are in UCI notation, e.g:
+
+  perft 6 r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq -
+  a2a3 b4c3 2713584
+  a2a3 b4b3 2432016
+  ...
+  a2a3 94405103
+
+  Records are flushed (and synced to disk) as soon as a subtree is done, so a crash can lose at most
+  the subtree being searched. A line cut off by a crash is removed from the journal when it's read back.
+*/
+
+// counts read from the journal: INVALID_COUNT if not done
+#define INVALID_COUNT ((uint64) -1)
+
+uint64 PerftJournal::rootCounts[MAX_MOVES];
+uint64 PerftJournal::secondPlyCounts[MAX_MOVES][MAX_MOVES];
+
+// finds the index of a move (in UCI notation) in the given move list, -1 if not found
+int PerftJournal::findMove(const char *moveStr, Move *moves, int nMoves)
+{
+    for (int i = 0; i < nMoves; i++)
+    {
+        char str[6];
+        Utils::getMoveString(moves[i], str);
+        if (!strcmp(str, moveStr))
+            return i;
+    }
+    return -1;
+}
+
+// checks if the string is a valid count
+static bool isCount(const char *str)
+{
+    if (!*str)
+        return false;
+    for (; *str; str++)
+        if (*str < '0' || *str > '9')
+            return false;
+    return true;
+}
+
+// reads the completed subtrees from an existing journal
+// returns false if the journal belongs to a different run
+// validLength is set to the length of the journal up to the last complete line
+bool PerftJournal::readJournal(FILE *fp, const char *header, BoardPosition *pos, Move *rootMoves, int nRootMoves,
+                               long *validLength)
+{
+    char line[1024];
+    *validLength = 0;
+
+    if (!fgets(line, sizeof(line), fp))
+        return true;    // empty journal
+
+    if (strcmp(line, header))
+        return false;
+
+    *validLength = ftell(fp);
+
+    while (fgets(line, sizeof(line), fp))
+    {
+        // ignore incomplete (last) line
+        if (!strchr(line, '\n'))
+            break;
+
+        *validLength = ftell(fp);
+
+        char move1[16], move2[16], move3[32];
+        int n = sscanf(line, "%15s %15s %31s", move1, move2, move3);
+
+        int i = findMove(move1, rootMoves, nRootMoves);
+        if (i < 0 || n < 2 || !isCount(n == 2 ? move2 : move3))
+            continue;
+
+        if (n == 2)
+        {
+            rootCounts[i] = strtoull(move2, NULL, 10);
+        }
+        else
+        {
+            Move moves[MAX_MOVES];
+            BoardPosition newPos = *pos;
+            makeMove(&newPos, rootMoves[i]);
+            int nMoves = MoveGenerator::generateMoves(&newPos, moves);
+            int j = findMove(move2, moves, nMoves);
+            if (j >= 0)
+                secondPlyCounts[i][j] = strtoull(move3, NULL, 10);
+        }
+    }
+
+    return true;
+}
+
+void PerftJournal::writeRecord(FILE *fp, const char *record)
+{
+    fputs(record, fp);
+    fflush(fp);
+    fsync(fileno(fp));
+}
+
+// perft that records completed root move and second ply subtrees in the journal file
+// subtrees already in the journal (from an earlier, interrupted run) are not searched again
+// returns INVALID_COUNT if the journal can't be used
+uint64 PerftJournal::perft(BoardPosition *pos, const char *fen, int depth, const char *journalFile)
+{
+    Move rootMoves[MAX_MOVES];
+    int nRootMoves = MoveGenerator::generateMoves(pos, rootMoves);
+
+    if (depth < 3)
+        return ::perft<MoveGenerator>(pos, depth);
+
+    for (int i = 0; i < MAX_MOVES; i++)
+    {
+        rootCounts[i] = INVALID_COUNT;
+        for (int j = 0; j < MAX_MOVES; j++)
+            secondPlyCounts[i][j] = INVALID_COUNT;
+    }
+
+    char header[1024];
+    sprintf(header, "perft %d %.990s\n", depth, fen);
+
+    // read the journal left by an earlier run (if any)
+    FILE *fp = fopen(journalFile, "rb");
+    if (fp)
+    {
+        long validLength;
+        bool ok = readJournal(fp, header, pos, rootMoves, nRootMoves, &validLength);
+        fseek(fp, 0, SEEK_END);
+        long length = ftell(fp);
+        fclose(fp);
+        if (!ok)
+        {
+            printf("journal file %s belongs to a different position/depth\n", journalFile);
+            return INVALID_COUNT;
+        }
+
+        // remove the line cut off by a crash (so that new records aren't appended to it)
+        if (validLength < length)
+            truncate(journalFile, validLength);
+    }
+
+    fp = fopen(journalFile, "ab");
+    if (!fp)
+    {
+        printf("can't open journal file %s\n", journalFile);
+        return INVALID_COUNT;
+    }
+
+    if (ftell(fp) == 0)
+        writeRecord(fp, header);
+
+    uint64 total = 0;
+    uint32 resumed = 0;
+    for (int i = 0; i < nRootMoves; i++)
+    {
+        char move1[6], record[64];
+        Utils::getMoveString(rootMoves[i], move1);
+
+        if (rootCounts[i] != INVALID_COUNT)
+        {
+            total += rootCounts[i];
+            resumed++;
+            continue;
+        }
+
+        BoardPosition newPos = *pos;
+        makeMove(&newPos, rootMoves[i]);
+
+        Move moves[MAX_MOVES];
+        int nMoves = MoveGenerator::generateMoves(&newPos, moves);
+        uint64 count = 0;
+
+        for (int j = 0; j < nMoves; j++)
+        {
+            if (secondPlyCounts[i][j] != INVALID_COUNT)
+            {
+                count += secondPlyCounts[i][j];
+                continue;
+            }
+
+            BoardPosition newPos2 = newPos;
+            makeMove(&newPos2, moves[j]);
+            uint64 count2 = ::perft<MoveGenerator>(&newPos2, depth - 2);
+
+            char move2[6];
+            Utils::getMoveString(moves[j], move2);
+            sprintf(record, "%s %s %llu\n", move1, move2, count2);
+            writeRecord(fp, record);
+
+            count += count2;
+        }
+
+        sprintf(record, "%s %llu\n", move1, count);
+        writeRecord(fp, record);
+        printf("%s: %llu\n", move1, count);
+        fflush(stdout);
+
+        total += count;
+    }
+
+    fclose(fp);
+
+    if (resumed)
+        printf("%u root moves were read from the journal\n", resumed);
+
+    return total;
+}
@@ -0,0 +1,466 @@
+// perft job server: a long running process that keeps its tables and the hash table warm between jobs
+#include "chess.h"
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <deque>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#ifndef _WIN32
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <signal.h>
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0      // SIGPIPE is ignored instead
+#endif
+#endif
+
+/*
+  Protocol: text, one command per line (the same on stdin/stdout and on the socket)
+
+  perft <depth> [id <tag>] [divide] [nohash] [generator 088] (startpos | fen <fen>) [moves <move1> ...]
+      queues a perft job, the replies are:
+        divide <tag> <move> <count>         - count of every root move (with divide)
+        done <tag> <count> <ms> [cached]    - the result (cached: from an earlier job)
+        error <tag> <message>
+      tag is the job no (jobs are numbered from 1) if no id is given
+      nohash runs without the hash table and the result cache (e.g. for timing the move generator)
+      generator: only the 0x88 generator (MoveGeneratorLUT generates pseudo-legal moves, so it can't be used)
+  stats       - replies: stats jobs <n> cached <n> probes <n> hits <n>
+  clear       - empties the hash table and the result cache, replies: cleared
+  quit        - closes the connection (on stdin: exits when the queued jobs are done)
+  shutdown    - stops the server (when the queued jobs are done)
+
+  The commands of all the clients go to one queue and are processed in order, each perft job on all the
+  threads (ParallelPerft splits the root moves), so the replies to a client come in the order of its
+  commands. Results of jobs are kept (by position and depth), so repeated queries are answered
+  right away, and overlapping ones share the counts of their common subtrees in the hash table.
+*/
+
+#define MAX_CACHED_RESULTS  65536       // the result cache is emptied when it's full
+#define MAX_LINE            8192
+
+struct ServerClient
+{
+    FILE *out;          // stdout, or NULL for a socket client
+    int   socket;
+    std::mutex lock;
+
+    ServerClient(FILE *fp, int fd) : out(fp), socket(fd) {}
+    ~ServerClient()
+    {
+#ifndef _WIN32
+        if (!out)
+            close(socket);
+#endif
+    }
+
+    void send(const char *line)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        if (out)
+        {
+            fputs(line, out);
+            fflush(out);
+        }
+#ifndef _WIN32
+        else
+        {
+            // errors are ignored: the client may have gone away with jobs still queued
+            ssize_t ignored = ::send(socket, line, strlen(line), MSG_NOSIGNAL);
+            (void) ignored;
+        }
+#endif
+    }
+};
+
+enum ServerCommand { JOB_PERFT, JOB_STATS, JOB_CLEAR, JOB_ERROR };
+
+struct ServerJob
+{
+    ServerCommand command;
+    std::shared_ptr<ServerClient> client;
+    char   tag[64];
+    int    depth;
+    bool   divide;
+    bool   hashed;
+    const char *error;      // JOB_ERROR: replied in order with the other commands of the client
+    BoardPosition pos;
+};
+
+struct CachedResult
+{
+    uint64 total;
+    std::vector<std::pair<std::string, uint64> > moves;    // count of every root move
+};
+
+static std::mutex                queueLock;
+static std::condition_variable   queueChanged;
+static std::deque<ServerJob>     jobQueue;
+static bool                      stopping;
+static std::atomic<uint64>       nJobs(0);
+
+// used only by the job thread
+static std::map<std::string, CachedResult> resultCache;
+static uint64                    nCached;
+static bool                      hashAvailable;
+
+static void queueJob(const ServerJob &job)
+{
+    std::lock_guard<std::mutex> guard(queueLock);
+    jobQueue.push_back(job);
+    queueChanged.notify_one();
+}
+
+static void stopServer()
+{
+    std::lock_guard<std::mutex> guard(queueLock);
+    stopping = true;
+    queueChanged.notify_all();
+}
+
+// the key of a result: the position and the depth
+static std::string cacheKey(BoardPosition *pos, int depth)
+{
+    PackedPosition packed;
+    Utils::packPosition(pos, &packed);
+    std::string key((const char *) &packed, sizeof(packed));
+    key += (char) depth;
+    return key;
+}
+
+static void replyResult(ServerJob &job, const CachedResult &result, double ms, bool cached)
+{
+    char line[MAX_LINE];
+    if (job.divide)
+    {
+        for (size_t i = 0; i < result.moves.size(); i++)
+        {
+            sprintf(line, "divide %s %s %llu\n", job.tag, result.moves[i].first.c_str(), result.moves[i].second);
+            job.client->send(line);
+        }
+    }
+    sprintf(line, "done %s %llu %.3f%s\n", job.tag, result.total, ms, cached ? " cached" : "");
+    job.client->send(line);
+}
+
+static void runPerft(ServerJob &job)
+{
+    std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+
+    std::string key = cacheKey(&job.pos, job.depth);
+    if (job.hashed)
+    {
+        std::map<std::string, CachedResult>::iterator it = resultCache.find(key);
+        if (it != resultCache.end())
+        {
+            nCached++;
+            replyResult(job, it->second, 0, true);
+            return;
+        }
+    }
+
+    Move moves[MAX_MOVES];
+    uint32 nMoves = MoveGenerator::generateMoves(&job.pos, moves);
+
+    std::vector<PerftWorkItem> items(nMoves);
+    for (uint32 i = 0; i < nMoves; i++)
+    {
+        items[i].pos = job.pos;
+        makeMove(&items[i].pos, moves[i]);
+        items[i].multiplicity = 1;
+        items[i].count = 1;
+    }
+
+    // the root moves are split over the threads
+    if (job.depth > 1 && nMoves)
+        ParallelPerft::run(&items[0], nMoves, job.depth - 1, job.hashed);
+
+    CachedResult result;
+    result.total = 0;
+    for (uint32 i = 0; i < nMoves; i++)
+    {
+        char moveStr[6];
+        Utils::getMoveString(moves[i], moveStr);
+        result.moves.push_back(std::make_pair(std::string(moveStr), items[i].count));
+        result.total += items[i].count;
+    }
+
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+    replyResult(job, result, ms, false);
+
+    if (job.hashed)
+    {
+        if (resultCache.size() >= MAX_CACHED_RESULTS)
+            resultCache.clear();
+        resultCache[key] = result;
+    }
+}
+
+// runs the queued jobs, one at a time
+static void jobThread()
+{
+    for (;;)
+    {
+        ServerJob job;
+        {
+            std::unique_lock<std::mutex> guard(queueLock);
+            while (jobQueue.empty() && !stopping)
+                queueChanged.wait(guard);
+            if (jobQueue.empty())
+                return;
+            job = jobQueue.front();
+            jobQueue.pop_front();
+        }
+
+        char line[MAX_LINE];
+        switch (job.command)
+        {
+            case JOB_PERFT:
+                runPerft(job);
+                break;
+            case JOB_STATS:
+                sprintf(line, "stats jobs %llu cached %llu probes %llu hits %llu\n", (uint64) nJobs, nCached,
+                        PerftHashTable::probes, PerftHashTable::hits);
+                job.client->send(line);
+                break;
+            case JOB_CLEAR:
+                if (hashAvailable)
+                    PerftHashTable::clear();
+                resultCache.clear();
+                job.client->send("cleared\n");
+                break;
+            case JOB_ERROR:
+                sprintf(line, "error %s %s\n", job.tag, job.error);
+                job.client->send(line);
+                break;
+        }
+    }
+}
+
+// next word of the line (NULL at the end)
+static char *nextToken(char **line)
+{
+    char *p = *line;
+    while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')
+        p++;
+    if (!*p)
+        return NULL;
+
+    char *token = p;
+    while (*p && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n')
+        p++;
+    if (*p)
+        *p++ = 0;
+    *line = p;
+    return token;
+}
+
+// parses a perft command (after "perft"), returns an error message or NULL
+static const char *parsePerft(char *params, ServerJob *job)
+{
+    job->depth = 0;
+    job->divide = false;
+    job->hashed = hashAvailable;
+
+    char *depth = nextToken(&params);
+    if (!depth || (job->depth = atoi(depth)) < 1 || job->depth >= MAX_PERFT_DEPTH)
+        return "invalid depth";
+
+    char *token;
+    while ((token = nextToken(&params)))
+    {
+        if (!strcmp(token, "id"))
+        {
+            char *tag = nextToken(&params);
+            if (!tag)
+                return "missing id";
+            sprintf(job->tag, "%.63s", tag);
+        }
+        else if (!strcmp(token, "divide"))
+        {
+            job->divide = true;
+        }
+        else if (!strcmp(token, "nohash"))
+        {
+            job->hashed = false;
+        }
+        else if (!strcmp(token, "generator"))
+        {
+            char *generator = nextToken(&params);
+            if (!generator || strcmp(generator, "088"))
+                return "unknown generator";
+        }
+        else if (!strcmp(token, "startpos") || !strcmp(token, "fen"))
+        {
+            char *moves = strstr(params, "moves");
+            if (moves)
+                *moves = 0;     // so that the FEN parser doesn't see the moves
+
+            const char *error;
+            if (!strcmp(token, "startpos"))
+                Utils::readFENString("rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1", &job->pos);
+            else if (!Utils::parseFEN(params, &job->pos, &error))
+                return error;
+
+            if (!moves)
+                return NULL;
+
+            params = moves + 5;
+            while ((token = nextToken(&params)))
+            {
+                Move move;
+                if (!Utils::readMove(token, &job->pos, &move))
+                    return "illegal move";
+                makeMove(&job->pos, move);
+            }
+            return NULL;
+        }
+        else
+        {
+            return "unknown option";
+        }
+    }
+
+    return "missing position";
+}
+
+// handles a command line from a client, returns false when the client is done
+static bool processCommand(std::shared_ptr<ServerClient> client, char *line)
+{
+    char *params = line;
+    char *command = nextToken(&params);
+    if (!command)
+        return true;
+
+    ServerJob job;
+    job.client = client;
+    job.error = NULL;
+
+    if (!strcmp(command, "perft"))
+    {
+        job.command = JOB_PERFT;
+        sprintf(job.tag, "%llu", (uint64) ++nJobs);
+        job.error = parsePerft(params, &job);
+        if (job.error)
+            job.command = JOB_ERROR;
+        queueJob(job);
+    }
+    else if (!strcmp(command, "stats") || !strcmp(command, "clear"))
+    {
+        job.command = strcmp(command, "stats") ? JOB_CLEAR : JOB_STATS;
+        queueJob(job);
+    }
+    else if (!strcmp(command, "quit"))
+    {
+        return false;
+    }
+    else if (!strcmp(command, "shutdown"))
+    {
+        stopServer();
+        return false;
+    }
+    else
+    {
+        job.command = JOB_ERROR;
+        strcpy(job.tag, "-");
+        job.error = "unknown command";
+        queueJob(job);
+    }
+    return true;
+}
+
+#ifndef _WIN32
+static int listenSocket = -1;
+
+static void clientThread(std::shared_ptr<ServerClient> client)
+{
+    FILE *in = fdopen(dup(client->socket), "r");
+    if (!in)
+        return;
+
+    char line[MAX_LINE];
+    while (fgets(line, sizeof(line), in) && processCommand(client, line))
+        ;
+    fclose(in);
+
+    // a shutdown from this client stops the accept loop
+    std::lock_guard<std::mutex> guard(queueLock);
+    if (stopping)
+        shutdown(listenSocket, SHUT_RDWR);
+}
+
+static bool serveSocket(const char *socketPath)
+{
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(socketPath) >= sizeof(addr.sun_path))
+    {
+        printf("socket path too long: %s\n", socketPath);
+        return false;
+    }
+    strcpy(addr.sun_path, socketPath);
+
+    listenSocket = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(socketPath);     // left by an earlier server
+    if (listenSocket < 0 || bind(listenSocket, (sockaddr *) &addr, sizeof(addr)) || listen(listenSocket, 16))
+    {
+        printf("can't listen on %s\n", socketPath);
+        return false;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    printf("listening on %s\n", socketPath);
+    fflush(stdout);
+
+    for (;;)
+    {
+        int fd = accept(listenSocket, NULL, NULL);
+        if (fd < 0)
+            break;      // closed by shutdown
+
+        std::shared_ptr<ServerClient> client(new ServerClient(NULL, fd));
+        std::thread(clientThread, client).detach();
+    }
+
+    close(listenSocket);
+    unlink(socketPath);
+    return true;
+}
+#endif
+
+int PerftServer::run(const char *socketPath, bool hashed)
+{
+    hashAvailable = hashed;
+    std::thread worker(jobThread);
+    bool ok = true;
+
+    if (socketPath)
+    {
+#ifdef _WIN32
+        printf("-server with a socket isn't supported on windows (use -server -)\n");
+        ok = false;
+#else
+        ok = serveSocket(socketPath);
+#endif
+        stopServer();
+    }
+    else
+    {
+        std::shared_ptr<ServerClient> client(new ServerClient(stdout, -1));
+        char line[MAX_LINE];
+        while (fgets(line, sizeof(line), stdin) && processCommand(client, line))
+            ;
+        stopServer();
+    }
+
+    worker.join();
+    return ok ? 0 : 1;
+}
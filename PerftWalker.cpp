@@ -0,0 +1,129 @@
+// hashed perft as a resumable state machine (for interleaving walkers on a thread)
+#include "chess.h"
+
+// With a big hash table most probes miss the cache. perftHashed waits for each miss, a walker
+// instead issues a prefetch for the bucket and returns to the caller, which runs other walkers
+// before coming back to do the probe (see ParallelPerft::walkersPerThread).
+//
+// The recursion of perftHashed is replaced by an explicit stack of frames, one for each ply:
+//
+//   push:  the child position is made and its bucket prefetched - the walker suspends here
+//   step:  on resume the child is probed, and on a miss its moves are generated
+//          (children at depth 1 are just counted, without probes), then children are pushed one by one
+//   pop:   the count is stored in the hash table and added to the parent's
+
+// makes the position the top frame (of the given depth) and prefetches its hash table bucket
+void PerftWalker::push(BoardPosition *pos, uint32 depth)
+{
+    Frame *frame = &frames[ply];
+    frame->depth = depth;
+    frame->key = pos->hash;
+    if (Zobrist::useSymmetry)
+    {
+        uint32 symmetry;
+        frame->key = Zobrist::canonicalHash(pos, &symmetry);
+    }
+
+    if (depth >= 2)
+        PerftHashTable::prefetch(frame->key, depth);
+
+    entering = true;
+}
+
+// the top frame is done: perft of it is count
+void PerftWalker::leave(uint64 count)
+{
+    if (ply == 0)
+    {
+        result = count;
+        ply = -1;
+        return;
+    }
+
+    ply--;
+    frames[ply].count += count;
+    frames[ply].current++;
+}
+
+// the top frame is done after visiting its children: store the count in the hash table
+void PerftWalker::pop(uint64 count)
+{
+    PerftHashTable::store(frames[ply].key, frames[ply].depth, count);
+    leave(count);
+}
+
+void PerftWalker::start(BoardPosition *pos, uint32 depth)
+{
+    ply = 0;
+    result = 0;
+    frames[0].pos = *pos;
+    frames[0].pos.hash = Zobrist::computeHash(pos);
+    if (Zobrist::useSymmetry)
+        Zobrist::computeSymmetricHashes(&frames[0].pos);
+    push(&frames[0].pos, depth);
+}
+
+bool PerftWalker::step()
+{
+    while (ply >= 0)
+    {
+        Frame *frame = &frames[ply];
+
+        if (entering)
+        {
+            entering = false;
+
+            uint64 count;
+            if (frame->depth >= 2 && PerftHashTable::probe(frame->key, frame->depth, &count))
+            {
+                leave(count);
+                continue;
+            }
+
+            uint32 childBound;
+            frame->nMoves = MoveGenerator::generateMoves(&frame->pos, frame->moves, &childBound);
+            frame->current = 0;
+            frame->count = 0;
+
+            if (frame->depth == 1)
+            {
+                leave(frame->nMoves);
+                continue;
+            }
+
+            if (frame->depth == 2)
+            {
+                // children are leaf nodes of the hashed search, no need to suspend for them
+                for (uint32 i = 0; i < frame->nMoves; i++)
+                {
+                    BoardPosition newPos = frame->pos;
+                    makeMove(&newPos, frame->moves[i]);
+                    PackedMove childMoves[MAX_MOVES];
+                    frame->count += MoveGenerator::generateMoves(&newPos, childMoves, &childBound);
+                }
+                pop(frame->count);
+                continue;
+            }
+        }
+
+        if (frame->current < frame->nMoves)
+        {
+            // visit the next child: suspend after prefetching its bucket
+            PackedMove move = frame->moves[frame->current];
+            BoardPosition *newPos = &frames[ply + 1].pos;
+            *newPos = frame->pos;
+            makeMove(newPos, move);
+            newPos->hash = Zobrist::updateHash(&frame->pos, newPos, move);
+            if (Zobrist::useSymmetry)
+                Zobrist::updateSymmetricHashes(&frame->pos, newPos, move);
+
+            ply++;
+            push(newPos, frame->depth - 1);
+            return true;
+        }
+
+        pop(frame->count);
+    }
+
+    return false;
+}
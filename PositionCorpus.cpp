@@ -0,0 +1,206 @@
+// corpus of positions in a binary file: packed positions that are used straight from a read only mapping
+#include "chess.h"
+#include <vector>
+
+/*
+  File format (little endian, as written by the machine):
+
+    CorpusHeader    64 bytes
+    PackedPosition  32 bytes each, count of them
+
+  Positions are stored as Utils::packPosition encodes them (the clocks aren't kept), so a corpus is read
+  with no parsing at all: the file is mapped in memory and the records are unpacked (a few shifts and
+  table lookups per square) where they are used, or compared/hashed as they are.
+
+  -makecorpus reads FEN/EPD files, or leaf dumps (see LeafDump.cpp), which are compressed for writing speed
+  and size, but have to be expanded to be used in place.
+*/
+
+#define CORPUS_MAGIC    "PERFTPOS"
+#define CORPUS_VERSION  1
+
+struct CorpusHeader
+{
+    char   magic[8];
+    uint32 version;
+    uint32 recordSize;      // sizeof(PackedPosition)
+    uint64 count;           // no of positions
+    uint8  reserved[40];    // zero (the positions that follow are 64 byte aligned)
+};
+CT_ASSERT(sizeof(CorpusHeader) == 64);
+
+PositionCorpus::PositionCorpus()
+{
+    positions = NULL;
+    count = 0;
+    mapping = NULL;
+    mappingSize = 0;
+}
+
+PositionCorpus::~PositionCorpus()
+{
+    close();
+}
+
+bool PositionCorpus::open(const char *filename)
+{
+    close();
+
+    uint64 size;
+    const void *ptr = Memory::mapFileReadOnly(filename, &size);
+    if (!ptr)
+        return false;
+
+    const CorpusHeader *header = (const CorpusHeader *) ptr;
+    if (size < sizeof(CorpusHeader) || memcmp(header->magic, CORPUS_MAGIC, sizeof(header->magic)) ||
+        header->version != CORPUS_VERSION || header->recordSize != sizeof(PackedPosition) ||
+        header->count > (size - sizeof(CorpusHeader)) / sizeof(PackedPosition))
+    {
+        Memory::unmapFile(ptr, size);
+        return false;
+    }
+
+    mapping = ptr;
+    mappingSize = size;
+    positions = (const PackedPosition *) (header + 1);
+    count = header->count;
+    return true;
+}
+
+void PositionCorpus::close()
+{
+    if (mapping)
+        Memory::unmapFile(mapping, mappingSize);
+
+    positions = NULL;
+    count = 0;
+    mapping = NULL;
+    mappingSize = 0;
+}
+
+// the corpus header, with the no of positions that follow
+static void writeHeader(FILE *out, uint64 count)
+{
+    CorpusHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CORPUS_MAGIC, sizeof(header.magic));
+    header.version = CORPUS_VERSION;
+    header.recordSize = sizeof(PackedPosition);
+    header.count = count;
+    fwrite(&header, sizeof(header), 1, out);
+}
+
+// a (compressed) leaf dump is expanded to a corpus (the positions are already packed)
+static int convertLeafDump(LeafReader *reader, const char *outputFile)
+{
+    FILE *out = fopen(outputFile, "wb");
+    if (!out)
+    {
+        printf("can't create %s\n", outputFile);
+        reader->close();
+        return 1;
+    }
+
+    writeHeader(out, reader->count);
+
+    std::vector<PackedPosition> positions(LEAF_BLOCK_POSITIONS);
+    uint64 count = 0;
+    bool ok = true;
+    uint32 n;
+    while (ok && (n = reader->readBlock(&positions[0])))
+    {
+        ok = fwrite(&positions[0], sizeof(PackedPosition), n, out) == n;
+        count += n;
+    }
+    reader->close();
+
+    ok = (fclose(out) == 0) && ok;
+    if (!ok || count != reader->count)
+    {
+        printf("error converting the leaf dump (%llu of %llu positions)\n", count, reader->count);
+        remove(outputFile);
+        return 1;
+    }
+
+    printf("%llu positions written to %s\n", count, outputFile);
+    return 0;
+}
+
+int PositionCorpus::convert(const char *inputFile, const char *outputFile)
+{
+    LeafReader reader;
+    if (reader.open(inputFile))
+        return convertLeafDump(&reader, outputFile);
+
+    FILE *in = fopen(inputFile, "r");
+    if (!in)
+    {
+        printf("can't open %s\n", inputFile);
+        return 1;
+    }
+
+    FILE *out = fopen(outputFile, "wb");
+    if (!out)
+    {
+        printf("can't create %s\n", outputFile);
+        fclose(in);
+        return 1;
+    }
+    setvbuf(out, NULL, _IOFBF, 1024 * 1024);
+
+    // the count is filled in at the end
+    uint64 count = 0;
+    writeHeader(out, 0);
+
+    std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+
+    char line[1024];
+    uint64 lineNo = 0, nInvalid = 0;
+    bool ok = true;
+    while (fgets(line, sizeof(line), in))
+    {
+        lineNo++;
+
+        const char *fen = line;
+        while (*fen == ' ' || *fen == '\t')
+            fen++;
+        if (!*fen || *fen == '\r' || *fen == '\n' || *fen == '#')
+            continue;
+
+        // EPD operations (or anything else after the FEN fields) are ignored
+        BoardPosition pos;
+        const char *error;
+        if (!Utils::parseFEN(fen, &pos, &error))
+        {
+            if (nInvalid++ < 10)
+                printf("line %llu skipped: %s\n", lineNo, error);
+            continue;
+        }
+
+        PackedPosition packed;
+        Utils::packPosition(&pos, &packed);
+        if (fwrite(&packed, sizeof(packed), 1, out) != 1)
+        {
+            ok = false;
+            break;
+        }
+        count++;
+    }
+    fclose(in);
+
+    fseek(out, 0, SEEK_SET);
+    writeHeader(out, count);
+    ok = !ferror(out) && ok;
+    ok = (fclose(out) == 0) && ok;
+    if (!ok)
+    {
+        printf("error writing %s (out of disk space?)\n", outputFile);
+        remove(outputFile);
+        return 1;
+    }
+
+    double seconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+    printf("%llu positions written to %s (%llu invalid lines skipped) in %g seconds\n", count, outputFile,
+           nInvalid, seconds);
+    return 0;
+}
@@ -1,326 +1,239 @@
 // UCI Interfacing routines
 #include "chess.h"
-
-
-
-// old code for copying pasting
-#if 0
-// for CreateThread method.
-#include <windows.h>
-
-
-// handles of the threads
-HANDLE hSearchThread;
-HANDLE hTimerThread;
-move_list_item bestMove;
-long maxFixedDepth=30;
-
-// Added for getting the time: Start
-unsigned long long t1, t2;
-// Added for getting the time: End
-
-
-long WINAPI searchThread(long param) {
-	int depth;
-	for(depth=5;depth<maxFixedDepth;depth++) {
-
-		//util::dispBoard(board);
-
-		Search::alphaBeta(depth, -INF, INF, 0);
-		bestMove=current_move_line[depth];
-
-		// display the move found at this depth
-		//util::dispBoard(board);
-		//printfs("\n%d %d %d %d\n", chance, castleflagB, castleflagW, enPassentFlag);
-		//printf("info depth %d pv ", depth );
-		//util::displayMove(bestMove);
-
-		fflush(stdout);
-	}
-
-	// Added for getting time: Start
-	struct _timeb timebuffer;
-	_ftime( &timebuffer );
-	t2 = timebuffer.time*1000 + timebuffer.millitm;
-
-	printf("\nTime Taken: %llu ms\n\n", t2-t1);
-	//printf("\n\n\nNPS: %lf\n", totalNodes/((t2-t1)*1000.0f));
-	fflush(stdout);
-	// Added for getting time: End
-
-	// never normally returns
-	return 0;
+#include <thread>
+#include <atomic>
+
+// this isn't a chess engine, only the parts of the UCI protocol needed to set up positions and run perft:
+//
+//   uci, isready, ucinewgame, quit
+//   position [startpos | fen <fen>] [moves <move1> <move2> ...]
+//   go perft <depth>       - perft (with node counts for each root move) on a background thread
+//   perft <depth>          - same as above
+//   stop                   - stops the running perft
+//
+// other commands (position, go, etc) received while perft is running wait for it to finish
+// (a GUI sends stop first), so a list of commands can be piped in for batch perft runs
+//   d                      - displays the current board
+//
+// "go" without perft just replies with a legal move (the first one generated)
+
+#define START_POSITION_FEN "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1"
+
+BoardPosition UciInterface::pos;
+
+static std::thread       perftWorker;
+static std::atomic<bool> stopRequested(false);
+
+
+// sets the position from the "position" command
+void UciInterface::setPosition(char *params)
+{
+    char *moves = strstr(params, "moves");
+    if (moves)
+        *moves = 0;     // so that the FEN parser doesn't see the moves
+
+    if (strstr(params, "startpos"))
+    {
+        Utils::readFENString(START_POSITION_FEN, &pos);
+    }
+    else
+    {
+        char *fen = strstr(params, "fen");
+        if (!fen)
+            return;
+
+        // an invalid position is ignored (the current one is kept)
+        BoardPosition newPos;
+        const char *error;
+        if (!Utils::parseFEN(fen + 3, &newPos, &error))
+        {
+            printf("info string invalid fen: %s\n", error);
+            return;
+        }
+        pos = newPos;
+    }
+
+    if (!moves)
+        return;
+
+    // read and make the moves
+    char *token = strtok(moves + 5, " \t\r\n");
+    while (token)
+    {
+        Move move;
+        if (!Utils::readMove(token, &pos, &move))
+        {
+            printf("info string illegal move: %s\n", token);
+            break;
+        }
+        makeMove(&pos, move);
+        token = strtok(NULL, " \t\r\n");
+    }
 }
 
-void dispBestMoveFound() {
-	printf("bestmove ");
-	util::displayMove(bestMove);
-	fflush(stdout);
+// perft that can be stopped
+// stop is checked only at nodes far from the leaves, the rest is done by the (faster) normal perft
+uint64 UciInterface::perftCancellable(BoardPosition *position, int depth)
+{
+    if (depth <= 3)
+        return perft<MoveGenerator>(position, depth);
+
+    Move moves[MAX_MOVES];
+    uint32 nMoves = MoveGenerator::generateMoves(position, moves);
+    uint64 count = 0;
+
+    for (uint32 i = 0; i < nMoves && !stopRequested; i++)
+    {
+        BoardPosition newPos = *position;
+        makeMove(&newPos, moves[i]);
+        count += perftCancellable(&newPos, depth - 1);
+    }
+
+    return count;
 }
 
-long WINAPI timerThread(long searchTime)
-{ 
-	// create the searchThread and wait for searchTime;
-	unsigned long iID;
-	hSearchThread = CreateThread(NULL,0,(LPTHREAD_START_ROUTINE)searchThread,NULL,0,&iID);
-
-	WaitForSingleObject(hSearchThread, searchTime);
-	TerminateThread(hSearchThread, 0);
-	
-	// display the best move found
-	dispBestMoveFound();
-
-	return 0;
+// runs on the perft thread: displays perft of each root move and the total
+void UciInterface::perftThread(BoardPosition position, int depth)
+{
+    Move moves[MAX_MOVES];
+    uint32 nMoves = MoveGenerator::generateMoves(&position, moves);
+    uint64 total = 0;
+
+    std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+
+    for (uint32 i = 0; i < nMoves && !stopRequested; i++)
+    {
+        uint64 count = 1;
+        if (depth > 1)
+        {
+            BoardPosition newPos = position;
+            makeMove(&newPos, moves[i]);
+            count = perftCancellable(&newPos, depth - 1);
+        }
+
+        if (stopRequested)
+            break;
+
+        char moveStr[6];
+        Utils::getMoveString(moves[i], moveStr);
+        printf("%s: %llu\n", moveStr, count);
+        fflush(stdout);
+        total += count;
+    }
+
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+
+    if (stopRequested)
+        printf("info string perft stopped\n");
+
+    printf("\nNodes searched: %llu\n", total);
+    printf("info string time %g seconds, nps %llu\n\n", ms / 1000.0, (uint64) (total / (ms / 1000.0 + 1e-9)));
+    fflush(stdout);
 }
 
-
-void search_go(char *params) {
-	long search_time=0;
-	long x=0;
-	long movestogo=0;
-	char * pos;
-	long maxDepth=0;
-	long inc=0;
-
-	pos = strstr(params, "movestogo");
-	if(pos) {
-		pos+=10;
-		sscanf(pos, "%d", &movestogo);
-	}
-
-	pos = strstr(params, "wtime");
-	if(pos&&chance==WHITE) {
-		pos+=6;
-		sscanf(pos, "%d", &x);
-	}
-
-	pos = strstr(params, "btime");
-	if(pos&&chance==BLACK) {
-		pos+=6;
-		sscanf(pos, "%d", &x);
-	}
-
-	pos = strstr(params, "depth");
-	if(pos) {
-		pos+=6;
-		sscanf(pos, "%d", &maxDepth);
-		if(maxDepth>2)
-			maxFixedDepth=maxDepth;
-	}	
-
-	pos = strstr(params, "movetime");
-	if(pos) {
-		pos+=9;
-		sscanf(pos, "%d", &search_time);
-	}
-
-	pos = strstr(params, "infinite");
-	if(pos) {
-		search_time = INF*INF;
-	}
-
-	pos = strstr(params, "winc");
-	if(pos&&chance==WHITE) {
-		pos+=5;
-		sscanf(pos, "%d", &inc);
-	}
-	pos = strstr(params, "binc");
-	if(pos&&chance==BLACK) {
-		pos+=5;
-		sscanf(pos, "%d", &inc);
-	}
-
-	if(!search_time) {
-			if(movestogo==0) movestogo = 60;
-			search_time = x/(movestogo) + inc;
-	}
-
-	//printf("searchtime: %d\n", search_time);
-
-
-	// create the timer thread and return
-	// the timer thread will control the searchThread and return after 
-
-
-	// Added for getting the time: Start
-	struct _timeb timebuffer;
-	_ftime( &timebuffer );
-	t1 = timebuffer.time*1000 + timebuffer.millitm;
-	// Added for getting the time: End
-
-
-	unsigned long iID;
-	hTimerThread = CreateThread(NULL,0,(LPTHREAD_START_ROUTINE)timerThread,(void *) search_time,0,&iID);
-
+void UciInterface::stop()
+{
+    stopRequested = true;
+    wait();
 }
 
+void UciInterface::wait()
+{
+    if (perftWorker.joinable())
+        perftWorker.join();
+    stopRequested = false;
+}
 
-
-// reads a move in algebric notation into a move_list_item
-int readMove(const char *move, move_list_item *mi) {
-	char r1, c1, r2, c2, q;
-
-	// ignore blank spaces
-	while(*move==' ') move++;
-
-	r1 = 7-(move[1]-'1');
-	c1 = move[0]-'a';
-	r2 = 7-(move[3]-'1');
-	c2 = move[2]-'a';
-	q = move[4];
-
-
-	mi->piece = board[r1][c1];
-	mi->oldpiece = board[r2][c2];
-
-	// special moves
-
-	// 1. En-Passent
-	if(mi->piece%10 == PAWN && mi->oldpiece==0 && c1!=c2) {
-		mi->r1=EN_PASSENT;
-		mi->r2=chance;
-		mi->c1=c1;
-		mi->c2=c2;
-		return 4;
-	}
-
-	// 2. Promotion
-	if(mi->piece==WHITE_PAWN && r2==0 || mi->piece==BLACK_PAWN && r2==7) {
-		mi->r1 = PROMOTION;
-		mi->r2 = util::getPieceCode(q)%10 + (chance+1)*10;
-		mi->c1 = c1;
-		mi->c2 = c2;
-		return 5;
-	}
-
-	// 3. Castling
-	if(mi->piece%10==KING && abs(c2-c1) > 1) {
-		mi->r1=CASTLING;
-		if(c2>c1) {		// king side
-			if(r1==0)	// black
-				mi->c1 = 11;
-			else
-				mi->c1 = 21;
-		}
-		else {
-			if(r1==0)
-				mi->c1 = 12;
-			else 
-				mi->c1 = 22;
-		}
-		return 4 ;
-	}
-	mi->r1=r1;
-	mi->c1=c1;
-	mi->r2=r2;
-	mi->c2=c2;
-	return 4;
+void UciInterface::go(char *params)
+{
+    char *perftParam = strstr(params, "perft");
+    if (perftParam)
+    {
+        int depth = 0;
+        sscanf(perftParam + 5, "%d", &depth);
+        if (depth < 1)
+        {
+            printf("info string invalid perft depth\n");
+            return;
+        }
+
+        wait();
+        perftWorker = std::thread(perftThread, pos, depth);
+        return;
+    }
+
+    // not a search engine: just reply with the first legal move
+    wait();
+    StagedMoveGenerator gen;
+    gen.init(&pos);
+    Move move;
+    char moveStr[6] = "0000";
+    if (gen.nextMove(&move))
+        Utils::getMoveString(move, moveStr);
+    printf("bestmove %s\n", moveStr);
 }
 
-void UciInterface::processCommand() {
-
-	char buffer[8192];
-	char *input = buffer;
-
-
-	// the main game loop
-	while(1) {
-		input = buffer;
-		gets(input);
-		if(strstr(input, "ucinewgame")) {
-			// new game
-			init();
-		}
-		else if(strstr(input, "uci")) {
-			// first command to indicate uci mode
-
-			// send back the IDs
-			printf("id name DeltaChess 0.00\n");
-			printf("id author Ankan Banerjee\n");
-
-			// send the "uciok" command
-			printf("uciok\n");
-		}
-		else if(strstr(input, "isready")) {
-			// send back readyok command
-			printf("readyok\n");
-		}
-		else if(strstr(input, "position")) {
-			if(strstr(input, "startpos")) {
-				util::readFENString("rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1");
-			}
-			else {
-				// read the fen string
-				input = input + 9;	// skip the "position "
-				util::readFENString(input);
-			}
-			// read the moves
-			input = strstr(input, "moves");
-			if(input==0) continue;
-			input += 6;	// skip the "moves "
-			while((*input) && (*input)!='\n') {
-				move_list_item move;
-				int mlen = readMove(input, &move);
-				MoveMaker::makeMove(&move);
-				input+=mlen;
-				// ignore blank spaces
-				while(*input==' ') input++;
-			}
-				
-		}
-		else if(strstr(input, "quit")) {
-			exit(0);
-		}
-		else if(strstr(input, "dispboard")) {
-			util::dispBoard(board);
-		}
-		else if(strstr(input, "go")) {
-			// ready for some action
-			input+=3;
-			search_go(input);
-		}
-		else if(strstr(input, "bench")) {
-			util::readFENString("rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1");
-			sscanf(input+6, "%d", &maxFixedDepth);
-			printf("Running Bench mark at depth %d. Please wait or type 'quit' to abort...\n", maxFixedDepth);
-
-			// Added for getting the time: Start
-			struct _timeb timebuffer;
-			_ftime( &timebuffer );
-			t1 = timebuffer.time*1000 + timebuffer.millitm;
-			// Added for getting the time: End
-
-			unsigned long iID;
-			hTimerThread = CreateThread(NULL,0,(LPTHREAD_START_ROUTINE)timerThread,(void *) 1000000000,0,&iID);
-
-		}
-		else if(strstr(input, "stop")) {
-			// stop the current line of search, and display the best move found
-			TerminateThread(hTimerThread, 0);
-			TerminateThread(hSearchThread, 0);
-			// display the best move found
-			dispBestMoveFound();
-
-		}
-		fflush(stdout);
-
-	}
-
-
-
-
-	/*
-	hThread = CreateThread(NULL,0,(LPTHREAD_START_ROUTINE)thread2,NULL,0,&iID);
-
-	for(int i=0;i<1000000000;i++)
-		if(!(i%1000000))
-			printf("In orig thread: %d\n", i/1000000);
-
-	WaitForSingleObject(hThread, 50);
-	TerminateThread(hThread, 0);
-*/
-
-
-	exit(0);
+void UciInterface::processCommands()
+{
+    char buffer[8192];
+
+    Utils::readFENString(START_POSITION_FEN, &pos);
+
+    // the main loop
+    while (fgets(buffer, sizeof(buffer), stdin))
+    {
+        char *input = buffer;
+        while (*input == ' ' || *input == '\t')
+            input++;
+
+        // commands are matched at the start of the line
+        // (e.g. "go perft" must not be mistaken for "position" or the other way round)
+        if (!strncmp(input, "ucinewgame", 10))
+        {
+            wait();
+            Utils::readFENString(START_POSITION_FEN, &pos);
+        }
+        else if (!strncmp(input, "uci", 3))
+        {
+            // send back the IDs
+            printf("id name perft\n");
+            printf("id author Ankan Banerjee\n");
+            printf("uciok\n");
+        }
+        else if (!strncmp(input, "isready", 7))
+        {
+            printf("readyok\n");
+        }
+        else if (!strncmp(input, "position", 8))
+        {
+            // positions can't be changed (and move generator can't be used) while perft is running
+            wait();
+            setPosition(input + 8);
+        }
+        else if (!strncmp(input, "go", 2))
+        {
+            go(input + 2);
+        }
+        else if (!strncmp(input, "perft", 5))
+        {
+            go(input);
+        }
+        else if (!strncmp(input, "stop", 4))
+        {
+            stop();
+        }
+        else if (!strncmp(input, "d", 1) && (input[1] == '\n' || input[1] == '\r' || input[1] == 0))
+        {
+            Utils::dispBoard(&pos);
+        }
+        else if (!strncmp(input, "quit", 4))
+        {
+            stop();
+            return;
+        }
+        fflush(stdout);
+    }
+
+    // end of input (e.g. commands piped from a file): let the last perft finish
+    wait();
 }
-#endif
\ No newline at end of file
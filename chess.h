@@ -1,15 +1,53 @@
 #include <stdlib.h>
 #include <stdio.h>
-#include <conio.h>
 #include <string.h>
 #include <assert.h>
+#include <chrono>
+
+#ifdef _WIN32
+#include <conio.h>
+#include <malloc.h>
 #include <windows.h>
+#include <xmmintrin.h>
+#define PREFETCH(addr) _mm_prefetch((const char *) (addr), _MM_HINT_T0)
+#else
+#include <alloca.h>
+// MSVC specific keywords
+#define __forceinline
+#define _alloca alloca
+#define PREFETCH(addr) __builtin_prefetch(addr)
+#endif
 
 typedef unsigned char      uint8;
 typedef unsigned short     uint16;
 typedef unsigned int       uint32;
 typedef unsigned long long uint64;
 
+// index of the lowest set bit (x must not be zero)
+#ifdef _WIN32
+#include <intrin.h>
+static __forceinline uint32 bitScanForward(uint64 x)
+{
+    unsigned long index;
+    _BitScanForward64(&index, x);
+    return index;
+}
+#else
+static inline uint32 bitScanForward(uint64 x)
+{
+    return (uint32) __builtin_ctzll(x);
+}
+#endif
+
+// no of set bits (without the popcnt instruction, which not all x64 CPUs have)
+static inline uint32 popCount(uint64 x)
+{
+    x = x - ((x >> 1) & 0x5555555555555555ULL);
+    x = (x & 0x3333333333333333ULL) + ((x >> 2) & 0x3333333333333333ULL);
+    x = (x + (x >> 4)) & 0x0F0F0F0F0F0F0F0FULL;
+    return (uint32) ((x * 0x0101010101010101ULL) >> 56);
+}
+
 #define CT_ASSERT(expr) \
 int __static_assert(int static_assert_failed[(expr)?1:-1])
 
@@ -90,6 +128,10 @@ int __static_assert(int static_assert_failed[(expr)?1:-1])
 
 #define ISVALIDPOS(index088)        (((index088) & 0x88) == 0)
 
+// conversion between 0x88 index and 0-63 index (rank * 8 + file)
+#define INDEX64(index088)           (((index088) + ((index088) & 7)) >> 1)
+#define INDEX088_FROM64(index64)    ((index64) + ((index64) & ~7))
+
 // special move flags
 #define CASTLE_QUEEN_SIDE  1
 #define CASTLE_KING_SIDE   2
@@ -103,6 +145,16 @@ int __static_assert(int static_assert_failed[(expr)?1:-1])
 #define CASTLE_FLAG_KING_SIDE   BIT(CASTLE_KING_SIDE)
 #define CASTLE_FLAG_QUEEN_SIDE  BIT(CASTLE_QUEEN_SIDE)
 
+// castle flags of both sides combined in 4 bits (0 - 15)
+#define CASTLE_INDEX(pos)       (((pos)->whiteCastle >> 1) | (((pos)->blackCastle >> 1) << 2))
+
+// stages for staged (lazy) move generation
+#define STAGE_CAPTURES     0    // captures, en-passent and promotions
+#define STAGE_QUIETS       1    // all other moves except castling
+#define STAGE_CASTLES      2
+#define NUM_STAGES         3
+#define ALL_STAGES         (BIT(STAGE_CAPTURES) | BIT(STAGE_QUIETS) | BIT(STAGE_CASTLES))
+
 // size 128 bytes
 // let's hope this fits in register file
 struct BoardPosition
@@ -120,21 +172,35 @@ struct BoardPosition
             uint8 blackCastle;   // whether black can castle
             uint8 enPassent;     // col + 1 (where col is the file on which enpassent is possible)
 
-            uint8 row1[8]; uint8 padding1[8];
-            uint8 row2[8]; uint8 padding2[8];
-            uint8 row3[8]; uint8 padding3[8];
-            uint8 row4[8]; uint8 padding4[8];
+            uint8 row1[8]; uint64 hash;     // zobrist hash (only maintained by hashed perft)
+            uint8 row2[8]; uint64 flipHash;         // zobrist hashes of the symmetric positions (see Zobrist class)
+            uint8 row3[8]; uint64 mirrorHash;       // (only maintained when symmetry is used)
+            uint8 row4[8]; uint64 flipMirrorHash;
             uint8 row5[8]; uint8 padding5[8];
             uint8 row6[8]; uint8 padding6[8];
             uint8 row7[8]; uint8 padding7[8];
 
-            // 60 unused bytes (padding) available for storing other structures if needed
+            // 28 unused bytes (padding) available for storing other structures if needed
         };
     };
 };
 
 CT_ASSERT(sizeof(BoardPosition) == 128);
 
+// compact encoding of a BoardPosition (for storing positions in files)
+// identical positions have identical encodings, so packed positions can be compared with memcmp
+struct PackedPosition
+{
+    uint64 occupied;        // bit i set if square i (0-63 index) has a piece
+    uint8  pieces[16];      // 4 bits per piece (color << 3 | piece), in the order of the occupied squares
+    uint8  chance;
+    uint8  whiteCastle;
+    uint8  blackCastle;
+    uint8  enPassent;
+    uint8  reserved[4];     // zero
+};
+CT_ASSERT(sizeof(PackedPosition) == 32);
+
 /*
        The board representation     Free space for other structures
 
@@ -161,6 +227,17 @@ struct Move
 };
 CT_ASSERT(sizeof(Move) == 4);
 
+// size 2 bytes
+// compact move used by perft: the copy-make perft never needs the captured piece
+// (it can be read from the board before making the move)
+struct PackedMove
+{
+    uint16 src   : 6;       // source square (0-63 index, not 0x88)
+    uint16 dst   : 6;       // destination square (0-63 index)
+    uint16 flags : 4;       // same flags as in Move
+};
+CT_ASSERT(sizeof(PackedMove) == 2);
+
 
 // Look up table used for fast (branchless) move generation
 // see http://chessprogramming.wikispaces.com/Table-driven+Move+Generation
@@ -184,6 +261,16 @@ CT_ASSERT(sizeof(MoveLUTItem) == 4);
 // actually it's 27 for a queen when it's in the center of the board
 #define MAX_SINGLE_PIECE_MOVES 32
 
+// move lists in perft are allocated on stack using an upper bound on no of moves for the position
+// (much smaller than MAX_MOVES for most positions)
+#define MAX_PAWN_MOVES           4
+#define MAX_PROMOTING_PAWN_MOVES 12     // 3 destination squares x 4 promotions
+#define ALLOC_MOVE_LIST(n)  ((PackedMove *) _alloca((n) * sizeof(PackedMove)))
+
+// state of the move generators is kept in static members, one copy per thread
+// so that perft can be run on multiple threads
+#define THREAD_LOCAL thread_local
+
 
 
 /** Declarations for class/methods in MoveGenerator088.cpp **/
@@ -193,11 +280,17 @@ class MoveGenerator
 	friend class MoveGeneratorLUT;
 
 private:
-    static BoardPosition *pos;
-    static Move *moves;
-    static uint32 nMoves;
-    static uint32 chance;
-	static uint32 kingPos;	// position of king of current color
+    static THREAD_LOCAL BoardPosition *pos;
+    static THREAD_LOCAL Move *moves;
+    static THREAD_LOCAL PackedMove *packedMoves;     // non-null when generating compact moves
+    static THREAD_LOCAL uint32 nMoves;
+    static THREAD_LOCAL uint32 chance;
+	static THREAD_LOCAL uint32 kingPos;	// position of king of current color
+    static THREAD_LOCAL uint32 childMovesBound;      // upper bound on no of moves for the opponent (after any move)
+    static THREAD_LOCAL uint32 stageMask;            // stages for which moves are generated (ALL_STAGES normally)
+
+    // upper bound on no of moves by a single piece (indexed by piece)
+    static const uint32 pieceMovesBound[8];
 
     __forceinline static void addMove(uint32 src, uint32 dst, uint8 oldPiece, uint8 flags);
     __forceinline static void addPromotions(uint32 src, uint32 dst, uint8 oldPiece);
@@ -206,13 +299,15 @@ private:
     __forceinline static void generateOffsetedMoves(uint32 curPos, const uint32 jumpTable[], int n);
     __forceinline static void generateKnightMoves(uint32 curPos);
     __forceinline static void generateKingMoves(uint32 curPos);
+    __forceinline static void generateCastles(uint32 curPos);
     __forceinline static void generateSlidingMoves(const uint32 curPos, const uint32 offset);
     __forceinline static void generateRookMoves(uint32 curPos);
     __forceinline static void generateBishopMoves(uint32 curPos);
     __forceinline static void generateQueenMoves(uint32 curPos);
     __forceinline static void generateMovesForSquare(uint32 index088, uint32 colorpiece);
+    static void generateAllMoves(BoardPosition *position);
 
-    __forceinline static bool MoveGenerator::isInvalidMove(uint32 src, uint32 dst, uint8 oldPiece, uint8 flags);
+    __forceinline static bool isInvalidMove(uint32 src, uint32 dst, uint8 oldPiece, uint8 flags);
 	__forceinline static bool checkSlidingThreat(uint32 curPos, uint32 offset, uint32 piece1, uint32 piece2);
 	static bool isThreatened(const uint32 curPos, uint32 color);
 
@@ -221,23 +316,62 @@ public:
     // returns the no of moves generated
     static int generateMoves (BoardPosition *position, Move *generatedMoves);
 
+    // generates compact moves for the given board position
+    // also returns (in childBound) upper bound on no of moves in any position reached by the generated moves
+    static int generateMoves (BoardPosition *position, PackedMove *generatedMoves, uint32 *childBound);
+
+    // upper bound on no of moves for the given board position
+    static uint32 movesBound(BoardPosition *position);
+
+    // generates only the moves belonging to the given stage (see StagedMoveGenerator): moves of other stages
+    // are skipped where they are found, so they are never made or checked for legality
+    static int generateMoves (BoardPosition *position, Move *generatedMoves, uint32 stage);
+};
+
+// staged (lazy) move generation on top of MoveGenerator
+// captures/promotions are generated first, then quiet moves and castling last
+// moves of a stage are generated (and checked for legality) only when the caller asks for them, e.g:
+//
+//    StagedMoveGenerator gen;
+//    gen.init(&pos);
+//    while (gen.nextMove(&move)) { ... break on a cutoff ... }
+//
+// the position must be in the same state whenever nextMove is called (true for copy-make)
+class StagedMoveGenerator
+{
+private:
+    BoardPosition *pos;
+    uint32 stage;           // stage of the moves currently in the list
+    uint32 nMoves;
+    uint32 current;         // index of next move to return
+    Move   moves[MAX_MOVES];
+
+public:
+    void init(BoardPosition *position);
+
+    // gets the next move, generating the next stage(s) if needed
+    // returns false when there are no more moves
+    bool nextMove(Move *move);
+
+    // stage of the last move returned by nextMove
+    uint32 currentStage() { return stage; }
 };
 
 /** Declarations for class/methods in MoveGeneratorLUT.cpp **/
 class MoveGeneratorLUT
 {
 private:
-	// for table based move generation of sliding pieces
-	static MoveLUTItem slidingMoveTable[1456+896+560];	 // for queen, rook and bishop
-	static uint32      slidingModeStart[3][64];			 // start indices from all board positions for all sliding pieces
+	// the tables for table based move generation of sliding pieces are generated at compile time
+	// (see SlidingMoveLUT in MoveGeneratorLUT.cpp)
 
-    static BoardPosition *pos;
-    static Move *moves;
-    static uint32 nMoves;
-    static uint32 chance;
+    static THREAD_LOCAL BoardPosition *pos;
+    static THREAD_LOCAL Move *moves;
+    static THREAD_LOCAL PackedMove *packedMoves;     // non-null when generating compact moves
+    static THREAD_LOCAL uint32 nMoves;
+    static THREAD_LOCAL uint32 chance;
+    static THREAD_LOCAL uint32 childMovesBound;
 
-	// add move generated by 088 move generator to the look up table
-	static void addGeneratedMoves(uint32 &lutIndex, uint32 next1);
+	static void generateAllMoves(BoardPosition *position);
 
 	__forceinline static void generateSlidingMoves(uint32 piece, uint32 index88, uint32 index);
 
@@ -251,12 +385,12 @@ private:
     __forceinline static void generateKingMoves(uint32 curPos);
 
 public:
-	// initialize the look up tables used for table driven sliding move generation
-	static void init();
-
     // generates moves for the given board position
     // returns the no of moves generated
     static int generateMoves (BoardPosition *position, Move *generatedMoves);
+    static int generateMoves (BoardPosition *position, PackedMove *generatedMoves, uint32 *childBound);
+
+    static uint32 movesBound(BoardPosition *position) { return MoveGenerator::movesBound(position); }
 };
 
 
@@ -290,6 +424,9 @@ public:
 
 */
 
+// longest FEN string written by Utils::getFENString (64 pieces, 10 digit clocks), with the terminating null
+#define MAX_FEN_LENGTH 128
+
 class Utils {
 
 private:
@@ -319,9 +456,648 @@ public:
 
 
 	// reads a FEN string and sets board and other Game Data accorodingly
-	static void readFENString(char fen[], BoardPosition *pos);
+	// (without error reporting: for strings known to be valid, use parseFEN for input)
+	static void readFENString(const char fen[], BoardPosition *pos);
+
+    // reads a FEN string (or the fields of an EPD record: the clocks are optional) and checks that it's a
+    // position the move generator can handle: one king of each color, no pawns on the first or last rank,
+    // castling rights and en passant square matching the board, the side not to move not in check
+    // returns false with a description of the error (and the position cleared) if it isn't
+    static bool parseFEN(const char fen[], BoardPosition *pos, const char **error = NULL,
+                         int *halfMoveClock = NULL, int *fullMoveNumber = NULL);
+
+    // writes the FEN string of the position, returns its length
+    // the clocks are left out (i.e. only the EPD fields are written) if halfMoveClock is negative
+    static int getFENString(BoardPosition *pos, char fen[MAX_FEN_LENGTH], int halfMoveClock = 0,
+                            int fullMoveNumber = 1);
+
+    // gets a move in UCI (long algebraic) notation, e.g: e2e4, e7e8q
+    static void getMoveString(Move move, char str[6]);
+
+    // reads a move in UCI notation (by matching it against the legal moves in the position)
+    // returns false if the move isn't legal
+    static bool readMove(const char str[], BoardPosition *pos, Move *move);
 
 	// clears the board (i.e, makes all squares blank)
 	static void clearBoard(BoardPosition *pos);
 
-};
\ No newline at end of file
+    // transforms the position to its symmetric image (SYMMETRY_FLIP and/or SYMMETRY_MIRROR)
+    // the hashes aren't set
+    static void transformPosition(BoardPosition *pos, uint32 symmetry, BoardPosition *image);
+
+    // conversion to and from the compact encoding (the hash isn't stored: it's zero after unpacking)
+    static void packPosition(BoardPosition *pos, PackedPosition *packed);
+    static void unpackPosition(const PackedPosition *packed, BoardPosition *pos);
+
+};
+
+
+/** Declarations for routines in perft.cpp **/
+
+void makeMove(BoardPosition *pos, Move move);
+void makeMove(BoardPosition *pos, PackedMove move);
+
+// perft search (instantiated for MoveGenerator and MoveGeneratorLUT)
+template <class Generator>
+uint64 perft(BoardPosition *pos, int depth);
+
+// same as perft, without recursion: uses a preallocated per thread stack of positions and move lists
+template <class Generator>
+uint64 perftIterative(BoardPosition *pos, int depth);
+
+// perft using the hash table (PerftHashTable::init must be called first)
+template <class Generator>
+uint64 perftHashed(BoardPosition *pos, int depth);
+
+// same as perftHashed, but all children are made (and their hash table buckets prefetched) before visiting them
+template <class Generator>
+uint64 perftHashedPrefetch(BoardPosition *pos, int depth);
+
+// perft for all depths from 1 to maxDepth (counts[depth]) in a single pass
+template <class Generator>
+void perftAllDepths(BoardPosition *pos, int maxDepth, uint64 *counts);
+
+// for timing CPU code : start
+extern double gTime;
+#define START_TIMER { \
+    std::chrono::high_resolution_clock::time_point timerStart = std::chrono::high_resolution_clock::now();
+
+#define STOP_TIMER \
+    gTime = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - timerStart).count(); \
+    }
+// for timing CPU code : end
+
+
+/** Declarations for class/methods in UciInterface.cpp **/
+
+// minimal UCI interface: enough to set up positions and run perft ("go perft <depth>")
+// perft runs on a background thread and can be stopped with the "stop" command
+class UciInterface
+{
+private:
+    static BoardPosition pos;
+
+    // sets the position from the "position" command
+    static void setPosition(char *params);
+
+    static void go(char *params);
+
+    // stops the perft thread (if running) and waits for it to finish
+    static void stop();
+
+    // waits for the perft thread (if running) to finish
+    static void wait();
+
+    // runs on the perft thread
+    static void perftThread(BoardPosition position, int depth);
+
+    // perft that returns early (with a partial count) when stop is requested
+    static uint64 perftCancellable(BoardPosition *position, int depth);
+
+public:
+    // reads and processes UCI commands from stdin till "quit"
+    static void processCommands();
+};
+
+
+/** Declarations for class/methods in PerftJournal.cpp **/
+
+// resumable perft for long runs: completed root move and second ply subtree counts are
+// appended to a journal file, and a restarted run skips the subtrees found in the journal
+class PerftJournal
+{
+private:
+    static uint64 rootCounts[MAX_MOVES];
+    static uint64 secondPlyCounts[MAX_MOVES][MAX_MOVES];
+
+    static int  findMove(const char *moveStr, Move *moves, int nMoves);
+    static bool readJournal(FILE *fp, const char *header, BoardPosition *pos, Move *rootMoves, int nRootMoves,
+                            long *validLength);
+    static void writeRecord(FILE *fp, const char *record);
+
+public:
+    // returns (uint64) -1 if the journal can't be used (e.g. it's of a different position or depth)
+    static uint64 perft(BoardPosition *pos, const char *fen, int depth, const char *journalFile);
+};
+
+
+/** Declarations for class/methods in Numa.cpp **/
+
+#define MAX_NUMA_NODES  16
+#define MAX_NUMA_CPUS   256     // per node
+
+// placement of worker threads and of the hash table on NUMA systems
+// does nothing unless init is called (-numa option)
+class Numa
+{
+private:
+    static uint32 nodeCpuCount[MAX_NUMA_NODES];
+    static uint32 nodeCpus[MAX_NUMA_NODES][MAX_NUMA_CPUS];
+    static uint32 nodeIds[MAX_NUMA_NODES];     // system node no of the nodes used
+
+public:
+    static bool   enabled;
+    static bool   partitioned;  // a hash table for every node (instead of one interleaved over all the nodes)
+    static uint32 nNodes;
+
+    // reads the topology (only the first maxNodes nodes with cpus are used)
+    static void init(uint32 maxNodes);
+
+    // node of parallel perft worker thread no 'thread', and pinning the calling thread to a cpu of it
+    static uint32 threadNode(uint32 thread);
+    static void pinThread(uint32 thread);
+
+    // memory placement (for memory that isn't touched yet, or is moved)
+    static void interleave(void *ptr, uint64 size);
+    static void bindToNode(void *ptr, uint64 size, uint32 node);
+};
+
+
+/** Declarations for class/methods in PerftHash.cpp **/
+
+#define MAX_PERFT_DEPTH 32
+
+// symmetries that don't change perft of a position (can be combined)
+#define SYMMETRY_FLIP       1   // colors swapped and board flipped vertically (side to move swapped too)
+#define SYMMETRY_MIRROR     2   // board reflected left-right: only when nobody can castle
+#define N_SYMMETRIES        4   // including identity
+
+// the zobrist keys, generated at compile time (xorshift64* with a fixed seed)
+// keys are saved along with the counts in persistent hash tables (see PerftHashTable::init),
+// so the sequence must never change
+struct ZobristKeys
+{
+    uint64 pieceKeys[32][64];
+    uint64 castleKeys[16];
+    uint64 enPassentKeys[9];
+    uint64 chanceKey;
+    uint64 depthKeys[MAX_PERFT_DEPTH];
+
+    // keys for computing the hashes of the symmetric images (indexed by the piece/square in the original position)
+    uint64 symmetricPieceKeys[N_SYMMETRIES][32][64];
+    uint64 symmetricCastleKeys[N_SYMMETRIES][16];
+    uint64 symmetricEnPassentKeys[N_SYMMETRIES][9];
+
+    static constexpr uint64 random64(uint64 &state)
+    {
+        state ^= state >> 12;
+        state ^= state << 25;
+        state ^= state >> 27;
+        return state * 0x2545F4914F6CDD1DULL;
+    }
+
+    constexpr ZobristKeys() : pieceKeys(), castleKeys(), enPassentKeys(), chanceKey(), depthKeys(),
+                              symmetricPieceKeys(), symmetricCastleKeys(), symmetricEnPassentKeys()
+    {
+        uint64 state = 0x9E3779B97F4A7C15ULL;
+
+        // empty square (and invalid piece codes) don't change the hash
+        for (uint32 color = WHITE; color <= BLACK; color++)
+            for (uint32 piece = PAWN; piece <= KING; piece++)
+                for (uint32 sq = 0; sq < 64; sq++)
+                    pieceKeys[COLOR_PIECE(color, piece)][sq] = random64(state);
+
+        for (uint32 i = 1; i < 16; i++)
+            castleKeys[i] = random64(state);
+
+        for (uint32 i = 1; i < 9; i++)
+            enPassentKeys[i] = random64(state);
+
+        chanceKey = random64(state);
+
+        for (uint32 i = 0; i < MAX_PERFT_DEPTH; i++)
+            depthKeys[i] = random64(state);
+
+        // keys of the images: key of the transformed piece/square/flags
+        for (uint32 s = 0; s < N_SYMMETRIES; s++)
+        {
+            for (uint32 color = WHITE; color <= BLACK; color++)
+            {
+                uint32 imageColor = (s & SYMMETRY_FLIP) ? !color : color;
+                for (uint32 piece = PAWN; piece <= KING; piece++)
+                    for (uint32 sq = 0; sq < 64; sq++)
+                        symmetricPieceKeys[s][COLOR_PIECE(color, piece)][sq] =
+                            pieceKeys[COLOR_PIECE(imageColor, piece)][sq ^ ((s & SYMMETRY_FLIP) ? 56 : 0) ^
+                                                                      ((s & SYMMETRY_MIRROR) ? 7 : 0)];
+            }
+
+            // mirrored images are used only without castling rights, flipping swaps white and black rights
+            for (uint32 i = 0; i < 16; i++)
+                symmetricCastleKeys[s][i] = castleKeys[(s & SYMMETRY_FLIP) ? ((i >> 2) | ((i & 3) << 2)) : i];
+
+            for (uint32 i = 0; i < 9; i++)
+                symmetricEnPassentKeys[s][i] = enPassentKeys[(i && (s & SYMMETRY_MIRROR)) ? 9 - i : i];
+        }
+    }
+};
+
+// zobrist hashing of board positions
+//
+// For symmetry, the hashes of the symmetric images of a position (flipHash, etc) are maintained too.
+// They use the keys of the transformed piece/square etc, i.e. flipHash of a position is the hash of its
+// color flipped image, so the smallest of the hashes of the images is the same for all of them
+class Zobrist
+{
+private:
+    // read-only data: nothing is computed at startup
+    static constexpr ZobristKeys keys = ZobristKeys();
+
+    static constexpr const uint64 (&symmetricPieceKeys)[N_SYMMETRIES][32][64] = keys.symmetricPieceKeys;
+    static constexpr const uint64 (&symmetricCastleKeys)[N_SYMMETRIES][16]    = keys.symmetricCastleKeys;
+    static constexpr const uint64 (&symmetricEnPassentKeys)[N_SYMMETRIES][9]  = keys.symmetricEnPassentKeys;
+
+    __forceinline static uint64 squareDelta(const uint64 keys[32][64], BoardPosition *pos, BoardPosition *newPos,
+                                            uint32 index088);
+    __forceinline static uint64 updateHash(uint64 hash, const uint64 pieceKeys[32][64], const uint64 castleKeys[16],
+                                           const uint64 enPassentKeys[9], BoardPosition *pos, BoardPosition *newPos,
+                                           PackedMove move);
+
+public:
+    // pieceKeys: indexed by colorpiece and 0-63 square index (0 for empty square)
+    // castleKeys: indexed by CASTLE_INDEX, enPassentKeys: indexed by BoardPosition::enPassent
+    // chanceKey: black to move, depthKeys: for hash table entries, to keep counts of different depths apart
+    static constexpr const uint64 (&pieceKeys)[32][64]          = keys.pieceKeys;
+    static constexpr const uint64 (&castleKeys)[16]             = keys.castleKeys;
+    static constexpr const uint64 (&enPassentKeys)[9]           = keys.enPassentKeys;
+    static constexpr const uint64 &chanceKey                    = keys.chanceKey;
+    static constexpr const uint64 (&depthKeys)[MAX_PERFT_DEPTH] = keys.depthKeys;
+
+    // hashed perft and frontier perft treat symmetric positions as the same position
+    static bool useSymmetry;
+
+    static uint64 computeHash(BoardPosition *pos);
+
+    // hash of newPos (pos after making the move), computed incrementally from pos->hash
+    static uint64 updateHash(BoardPosition *pos, BoardPosition *newPos, PackedMove move);
+
+    // hashes of the symmetric images: from scratch, and incrementally (from the hashes of pos)
+    static void computeSymmetricHashes(BoardPosition *pos);
+    static void updateSymmetricHashes(BoardPosition *pos, BoardPosition *newPos, PackedMove move);
+
+    // hash of the position that's the same for all its symmetric images (needs the symmetric hashes)
+    // symmetry is set to the image the hash belongs to
+    static uint64 canonicalHash(BoardPosition *pos, uint32 *symmetry);
+};
+
+#define HASH_BUCKET_ENTRIES     6
+#define HASH_COUNT_BITS         35
+#define HASH_WIDE_COUNT         ((1ULL << HASH_COUNT_BITS) - (1ULL << 29))  // counts from here on take 2 entries
+
+// a cache line sized bucket of 6 entries, 10 bytes each
+// an entry has a 40 bit key check (the upper bits of the key, the lower bits are implied by the bucket),
+// 5 bits of depth and a 35 bit count. The depth is used for replacement (and is part of the check)
+// counts of HASH_WIDE_COUNT or more are split over 2 entries of the bucket: the count field of the entry
+// of the key is HASH_WIDE_COUNT | the upper 29 bits of the count, and a second entry (with the key check of
+// key ^ HASH_WIDE_KEY) has the lower 35 bits
+//
+// entries are stored as arrays of their fields so that a probe reads only the key checks of other entries
+struct HashBucket
+{
+    uint32 keyLo[HASH_BUCKET_ENTRIES];      // key check ^ data (bits 0..31)
+    uint32 dataLo[HASH_BUCKET_ENTRIES];     // data: depth << 35 | count (bits 0..31)
+    uint8  keyHi[HASH_BUCKET_ENTRIES];      // key check ^ data (bits 32..39)
+    uint8  dataHi[HASH_BUCKET_ENTRIES];     // data (bits 32..39)
+    uint8  padding[4];
+};
+CT_ASSERT(sizeof(HashBucket) == 64);
+
+#define HASH_FILE_HEADER_SIZE   64
+#define HUGE_PAGE_SIZE          (2 * 1024 * 1024)
+#define GIANT_PAGE_SIZE         (1024 * 1024 * 1024)
+
+// hash table for perft values, keyed by (position, depth)
+// entries of smaller depth are replaced first (they cost less to compute again)
+// optionally backed by a memory mapped file, so that the counts are saved and can be reused by later runs
+class PerftHashTable
+{
+private:
+    static THREAD_LOCAL HashBucket *table;     // the table of the thread's NUMA node (see Numa::partitioned)
+    static HashBucket *partitions[MAX_NUMA_NODES];
+    static uint32      nPartitions;
+    static uint64      mask;        // no of buckets (in each partition) - 1
+    static uint64      partitionSize;   // allocated size of each partition (see Memory::allocLarge)
+    static void       *mapping;     // non-null if the table is backed by a file
+    static uint64      mappingSize;
+
+public:
+    // statistics (of the calling thread, ParallelPerft adds the counts of its workers to the main thread's)
+    static THREAD_LOCAL uint64 probes;
+    static THREAD_LOCAL uint64 hits;
+
+    // filename can be NULL (table in RAM)
+    static bool init(uint64 sizeInMB, const char *filename);
+    static void release();
+
+    // removes all the entries (of all the partitions)
+    static void clear();
+
+    // threads other than the one calling init must select the table of their NUMA node before using the table
+    static void selectPartition(uint32 node);
+
+    static bool probe(uint64 hash, uint32 depth, uint64 *count);
+    static void store(uint64 hash, uint32 depth, uint64 count);
+
+    // starts loading the bucket of the entry into the cache (for a probe a little later)
+    static void prefetch(uint64 hash, uint32 depth)
+    {
+        PREFETCH(&table[(hash ^ Zobrist::depthKeys[depth]) & mask]);
+    }
+};
+
+
+/** Declarations for class/methods in Memory.cpp **/
+
+class Memory
+{
+public:
+    // maps a file in memory (read/write), creating it with the given size if it doesn't exist
+    // if the file already exists, size is set to its size (and created to false)
+    static void *mapFile(const char *filename, uint64 *size, bool *created);
+    static void unmapFile(const void *ptr, uint64 size);
+
+    // maps an existing file read only (size is set to its size), returns NULL on failure
+    static const void *mapFileReadOnly(const char *filename, uint64 *size);
+
+    // allocates zero filled memory for a big table, with the largest pages available (1 GB, 2 MB or
+    // transparent huge pages, falling back to normal pages); size is rounded up to a multiple of the page size
+    // pageSize is set to the size of the pages obtained, transparent if they are transparent huge pages
+    // (the kernel uses them when it can, but doesn't guarantee them)
+    // returns NULL on failure
+    static void *allocLarge(uint64 *size, uint64 *pageSize, bool *transparent);
+    static void freeLarge(void *ptr, uint64 size);
+};
+
+
+/** Declarations for class/methods in ParallelPerft.cpp **/
+
+// a position to run perft on, along with the no of times it occurs (e.g. in the frontier of a bigger perft)
+struct PerftWorkItem
+{
+    BoardPosition pos;
+    uint64 multiplicity;
+    uint64 count;           // perft of pos (set by ParallelPerft::run)
+};
+
+// runs perft of a list of positions on multiple threads
+// the positions are handed out biggest (estimated) subtree first, and the biggest ones are split
+// into their children, so that no thread is left with a long task at the end
+class ParallelPerft
+{
+public:
+    static uint32 nThreads;     // 0: one per hardware thread
+
+    // for hashed perft: no of PerftWalkers interleaved on each thread (1: plain perftHashed)
+    static uint32 walkersPerThread;
+
+    static uint32 threadCount();
+
+    // sets items[i].count to perft(depth) of items[i].pos and returns the sum of count * multiplicity
+    static uint64 run(PerftWorkItem *items, uint64 nItems, int depth, bool hashed);
+
+    // displays the no of tasks, busy and idle time of each thread (totals of all the runs)
+    static void printThreadStats();
+};
+
+
+/** Declarations for class/methods in PerftWalker.cpp **/
+
+// hashed perft of a subtree as a state machine that can be suspended:
+// step() runs till the walker needs a hash table probe, prefetches the bucket and returns, so a thread
+// can switch between several walkers and the latency of a probe is hidden by the work of the others
+class PerftWalker
+{
+private:
+    struct Frame
+    {
+        BoardPosition pos;
+        uint64 key;             // hash table key (canonical hash with Zobrist::useSymmetry)
+        uint64 count;           // perft of the children visited so far
+        uint32 depth;
+        uint32 nMoves;
+        uint32 current;         // child being visited
+        PackedMove moves[MAX_MOVES];
+    };
+
+    Frame  frames[MAX_PERFT_DEPTH];
+    int    ply;
+    bool   entering;            // frames[ply] was just pushed (its bucket is being prefetched)
+    uint64 result;
+
+    void push(BoardPosition *pos, uint32 depth);
+    void pop(uint64 count);
+    void leave(uint64 count);
+
+public:
+    void start(BoardPosition *pos, uint32 depth);
+
+    // returns false when perft of the subtree is done
+    bool step();
+
+    uint64 count() { return result; }
+};
+
+
+/** Declarations for class/methods in FrontierPerft.cpp **/
+
+// perft by expanding the tree to the frontier ply, merging identical positions (transpositions)
+// and running perft of the remaining depth only once for each unique position
+class FrontierPerft
+{
+public:
+    static uint64 perft(BoardPosition *pos, int depth, int frontierDepth, bool hashed);
+
+    // clears the en-passent flag (and updates the hash) if no en-passent capture is possible
+    static void clearUselessEnPassent(BoardPosition *pos);
+
+    // replaces the position with the symmetric image the canonical hash belongs to (for Zobrist::useSymmetry)
+    // the hash and the symmetric hashes must be set
+    static void canonicalize(BoardPosition *pos);
+};
+
+
+/** Declarations for class/methods in ExternalFrontier.cpp **/
+
+class LeafWriter;
+
+// frontier perft for frontiers that don't fit in memory: the positions of every ply are kept in files
+// in the given directory (packed), and identical positions are merged with an external merge sort
+class ExternalFrontier
+{
+public:
+    static uint64 perft(BoardPosition *pos, int depth, int frontierDepth, bool hashed, const char *dir,
+                        uint64 memoryInMB);
+
+    // writes every unique position at the given depth once (sorted by their packed encoding)
+    // returns the no of unique positions
+    static uint64 dump(BoardPosition *pos, int depth, const char *dir, uint64 memoryInMB, LeafWriter *writer);
+};
+
+
+/** Declarations for class/methods in PerftEstimator.cpp **/
+
+struct PerftEstimate
+{
+    double estimate;
+    double confidence;      // half width of the 95% confidence interval
+    uint64 samples;
+};
+
+// estimates perft of depths too big to enumerate by sampling random paths from the root
+// (perft of the last few plies of each path is computed exactly)
+class PerftEstimator
+{
+public:
+    static PerftEstimate estimate(BoardPosition *pos, int depth, double seconds);
+};
+
+
+/** Declarations for class/methods in BatchPerft.cpp **/
+
+// perft of a stream of positions ("[<depth>] <fen>" lines, from the file or stdin if NULL) on all the
+// threads, the counts are written to stdout in the order of the input (see BatchPerft.cpp)
+class BatchPerft
+{
+public:
+    static int run(const char *inputFile, int defaultDepth, bool hashed);
+};
+
+
+/** Declarations for class/methods in DistributedPerft.cpp **/
+
+// perft split into work units (the paths to the positions at the split depth) that are run by worker
+// processes, connected to the coordinator over TCP (see DistributedPerft.cpp for the protocol)
+class DistributedPerft
+{
+public:
+    // coordinator: starts nLocalWorkers worker processes (with hash tables of the given size), and listens
+    // on the port (a free one if 0) of the bind address (localhost only if NULL) for the workers
+    static uint64 perft(const char *fen, int depth, int splitDepth, uint32 nLocalWorkers, int port,
+                        const char *bindAddress, uint64 hashSizeInMB);
+
+    // worker: connects to the coordinator (<host>:<port>) and runs units till the coordinator is done
+    static int worker(const char *address, bool hashed);
+};
+
+
+/** Declarations for class/methods in PerftServer.cpp **/
+
+// long running perft job server: the hash table (and the results of earlier jobs) are kept between jobs
+// commands are read from stdin (socketPath NULL) or from clients of a unix domain socket
+// hashed: the hash table is allocated (and used by the jobs)
+class PerftServer
+{
+public:
+    static int run(const char *socketPath, bool hashed);
+};
+
+
+/** Declarations for class/methods in FenBenchmark.cpp **/
+
+// measures the speed of Utils::parseFEN and Utils::getFENString on the positions of a file (one per line),
+// checking that every position written back reads the same
+class FenBenchmark
+{
+public:
+    static int run(const char *inputFile);
+};
+
+
+/** Declarations for class/methods in PositionCorpus.cpp **/
+
+// a file of packed positions (see PositionCorpus.cpp), mapped read only: the positions are used in place,
+// with no parsing and no copies, e.g.
+//
+//    PositionCorpus corpus;
+//    if (corpus.open(file))
+//        for (uint64 i = 0; i < corpus.count; i++) { Utils::unpackPosition(&corpus.positions[i], &pos); ... }
+class PositionCorpus
+{
+private:
+    const void *mapping;
+    uint64      mappingSize;
+
+public:
+    const PackedPosition *positions;
+    uint64                count;
+
+    PositionCorpus();
+    ~PositionCorpus();
+
+    // returns false if the file can't be mapped or isn't a corpus (e.g. a text file)
+    bool open(const char *filename);
+    void close();
+
+    // writes the positions of a file of FEN/EPD lines (invalid lines are skipped), or of a leaf dump, to a
+    // corpus file
+    static int convert(const char *inputFile, const char *outputFile);
+};
+
+
+/** Declarations for class/methods in LeafDump.cpp **/
+
+// positions in a block of a leaf dump (1 MB of packed positions)
+#define LEAF_BLOCK_POSITIONS    32768
+
+struct LeafWriterState;
+
+// writer of a stream of positions (packed, compressed a block at a time, or FEN lines): positions are
+// collected in blocks in memory, which are compressed and written by an I/O thread (see LeafDump.cpp)
+class LeafWriter
+{
+private:
+    LeafWriterState *state;
+    uint8           *block;         // the block being filled
+    uint32           blockUsed;
+    bool             fen;
+
+    void flushBlock();
+
+public:
+    uint64 count;                   // no of positions written
+
+    // the filename can be "-" (stdout) for FEN lines
+    bool open(const char *filename, bool fenFormat);
+    void write(BoardPosition *pos);
+    void write(const PackedPosition *packed);
+
+    // waits for everything to be written, returns false if there was a write error
+    bool close(uint64 *fileSize);
+};
+
+// reader of a packed leaf dump, a block at a time
+class LeafReader
+{
+private:
+    FILE  *fp;
+    uint8 *buffer;
+
+public:
+    uint64 count;                   // no of positions in the dump
+
+    // returns false if the file can't be opened or isn't a leaf dump
+    bool open(const char *filename);
+
+    // reads the next block (up to LEAF_BLOCK_POSITIONS positions), returns the no of positions read (0 at the end)
+    uint32 readBlock(PackedPosition *positions);
+    void close();
+};
+
+class LeafDump
+{
+public:
+    // writes the positions at the given depth to the file: all the leaves of perft, or every unique position
+    // once (merged on disk in dir, see ExternalFrontier::dump)
+    static int dump(BoardPosition *pos, int depth, const char *filename, bool fen, bool unique, const char *dir,
+                    uint64 memoryInMB);
+};
+
+
+/** Declarations for class/methods in LeafSampler.cpp **/
+
+// uniform random sample of k positions at the given depth (reservoir sampling on all the threads), written to
+// the file like a leaf dump (seed 0: a different sample every run)
+class LeafSampler
+{
+public:
+    static int sample(BoardPosition *pos, int depth, uint64 k, uint64 seed, const char *filename, bool fen);
+};
@@ -4,20 +4,20 @@
 #include "chess.h"
 
 // routines to make a move on the board and to undo it
-void makeMove(BoardPosition *pos, Move move)
+__forceinline static void makeMove(BoardPosition *pos, uint32 src, uint32 dst, uint32 flags, uint8 capturedPiece)
 {
-    uint8 piece = PIECE(pos->board[move.src]);
+    uint8 piece = PIECE(pos->board[src]);
     uint32 chance = pos->chance;
 
-    pos->board[move.dst] = pos->board[move.src];
-    pos->board[move.src] = EMPTY_SQUARE;
+    pos->board[dst] = pos->board[src];
+    pos->board[src] = EMPTY_SQUARE;
 
-    if (move.flags)
+    if (flags)
     {
         // special  moves
 
         // 1. Castling: update the rook position too
-        if(move.flags == CASTLE_KING_SIDE)
+        if(flags == CASTLE_KING_SIDE)
         {
             if (chance == BLACK)
             {
@@ -31,7 +31,7 @@ void makeMove(BoardPosition *pos, Move move)
             }
                         
         }
-        else if (move.flags == CASTLE_QUEEN_SIDE)
+        else if (flags == CASTLE_QUEEN_SIDE)
         {
             if (chance == BLACK)
             {
@@ -46,27 +46,27 @@ void makeMove(BoardPosition *pos, Move move)
         }
 
         // 2. en-passent: clear the captured piece
-        else if (move.flags == EN_PASSENT)
+        else if (flags == EN_PASSENT)
         {
-            pos->board[INDEX088(RANK(move.src), pos->enPassent - 1)] = EMPTY_SQUARE;
+            pos->board[INDEX088(RANK(src), pos->enPassent - 1)] = EMPTY_SQUARE;
         }
 
         // 3. promotion: update the pawn to promoted piece
-        else if (move.flags == PROMOTION_QUEEN)
+        else if (flags == PROMOTION_QUEEN)
         {
-            pos->board[move.dst] = COLOR_PIECE(chance, QUEEN);
+            pos->board[dst] = COLOR_PIECE(chance, QUEEN);
         }
-        else if (move.flags == PROMOTION_ROOK)
+        else if (flags == PROMOTION_ROOK)
         {
-            pos->board[move.dst] = COLOR_PIECE(chance, ROOK);
+            pos->board[dst] = COLOR_PIECE(chance, ROOK);
         }
-        else if (move.flags == PROMOTION_KNIGHT)
+        else if (flags == PROMOTION_KNIGHT)
         {
-            pos->board[move.dst] = COLOR_PIECE(chance, KNIGHT);
+            pos->board[dst] = COLOR_PIECE(chance, KNIGHT);
         }
-        else if (move.flags == PROMOTION_BISHOP)
+        else if (flags == PROMOTION_BISHOP)
         {
-            pos->board[move.dst] = COLOR_PIECE(chance, BISHOP);
+            pos->board[dst] = COLOR_PIECE(chance, BISHOP);
         }
     }
 
@@ -88,39 +88,39 @@ void makeMove(BoardPosition *pos, Move move)
     {
         if (chance == BLACK)
         {
-            if (move.src == 0x77)
+            if (src == 0x77)
                 pos->blackCastle &= ~CASTLE_FLAG_KING_SIDE;
-            else if (move.src == 0x70)
+            else if (src == 0x70)
                 pos->blackCastle &= ~CASTLE_FLAG_QUEEN_SIDE;
         }
         else
         {
-            if (move.src == 0x7)
+            if (src == 0x7)
                 pos->whiteCastle &= ~CASTLE_FLAG_KING_SIDE;
-            else if (move.src == 0x0)
+            else if (src == 0x0)
                 pos->whiteCastle &= ~CASTLE_FLAG_QUEEN_SIDE;
         }
     }
-    else if ((piece == PAWN) && (abs(RANK(move.dst) - RANK(move.src)) == 2))
+    else if ((piece == PAWN) && (abs((int) RANK(dst) - (int) RANK(src)) == 2))
     {
-        pos->enPassent = FILE(move.src) + 1;
+        pos->enPassent = FILE(src) + 1;
     }
 
     // clear the appriopiate castle flag if a rook is captured
-    if (PIECE(move.capturedPiece) == ROOK)
+    if (PIECE(capturedPiece) == ROOK)
     {
         if (chance == BLACK)
         {
-            if (move.dst == 0x7)
+            if (dst == 0x7)
                 pos->whiteCastle &= ~CASTLE_FLAG_KING_SIDE;
-            else if (move.dst == 0x0)
+            else if (dst == 0x0)
                 pos->whiteCastle &= ~CASTLE_FLAG_QUEEN_SIDE;
         }
         else
         {
-            if (move.dst == 0x77)
+            if (dst == 0x77)
                 pos->blackCastle &= ~CASTLE_FLAG_KING_SIDE;
-            else if (move.dst == 0x70)
+            else if (dst == 0x70)
                 pos->blackCastle &= ~CASTLE_FLAG_QUEEN_SIDE;
         }
     }
@@ -129,6 +129,19 @@ void makeMove(BoardPosition *pos, Move move)
     pos->chance = !chance;
 }
 
+void makeMove(BoardPosition *pos, Move move)
+{
+    makeMove(pos, move.src, move.dst, move.flags, move.capturedPiece);
+}
+
+// the captured piece isn't stored in packed moves, read it from the board
+void makeMove(BoardPosition *pos, PackedMove move)
+{
+    uint32 src = INDEX088_FROM64(move.src);
+    uint32 dst = INDEX088_FROM64(move.dst);
+    makeMove(pos, src, dst, move.flags, pos->board[dst]);
+}
+
 // this has a bug - doesn't handle special moves like castling, etc correctly!
 void undoMove(BoardPosition *pos, Move move, uint8 bc, uint8 wc, uint8 enPassent)
 {
@@ -143,15 +156,16 @@ void undoMove(BoardPosition *pos, Move move, uint8 bc, uint8 wc, uint8 enPassent
 
 
 // perft search
+// maxMoves is an upper bound on no of moves in the position (used to size the move list)
 template <class Generator>
-uint64 perft(BoardPosition *pos, int depth)
+uint64 perft(BoardPosition *pos, int depth, uint32 maxMoves)
 {
-    // TODO: check if keeping this local variable is ok
-    Move moves[MAX_MOVES];
+    PackedMove *moves = ALLOC_MOVE_LIST(maxMoves);
     uint64 childPerft = 0;
+    uint32 childMaxMoves;
 
 
-    uint32 nMoves = Generator::generateMoves(pos, moves);
+    uint32 nMoves = Generator::generateMoves(pos, moves, &childMaxMoves);
 
     if (depth == 1)
     {
@@ -160,12 +174,9 @@ uint64 perft(BoardPosition *pos, int depth)
 
     for (uint32 i = 0; i < nMoves; i++)
     {
-        //uint8 blackCastle = pos->blackCastle;
-        //uint8 whiteCastle = pos->whiteCastle;
-        //uint8 enPassent   = pos->enPassent;
         BoardPosition newPos = *pos;
         makeMove(&newPos, moves[i]);
-        uint32 count = perft<Generator>(&newPos, depth - 1);
+        uint64 count = perft<Generator>(&newPos, depth - 1, childMaxMoves);
 
         /*
         if (depth == 3)
@@ -176,38 +187,561 @@ uint64 perft(BoardPosition *pos, int depth)
         */
         
         childPerft += count;
-        //undoMove(pos, moves[i], blackCastle, whiteCastle, enPassent);
     }
     return childPerft;
 }
 
-// for timing CPU code : start
-double gTime;
-#define START_TIMER { \
-    LARGE_INTEGER count1, count2, freq; \
-    QueryPerformanceFrequency (&freq);  \
-    QueryPerformanceCounter(&count1);
+template <class Generator>
+uint64 perft(BoardPosition *pos, int depth)
+{
+    return perft<Generator>(pos, depth, Generator::movesBound(pos));
+}
+
+// stack for perftIterative: the position and its moves for every ply, contiguous and allocated once per thread
+struct PerftStack
+{
+    BoardPosition positions[MAX_PERFT_DEPTH + 1];
+    PackedMove    moves[MAX_PERFT_DEPTH + 1][MAX_MOVES];
+    uint32        nMoves[MAX_PERFT_DEPTH + 1];
+    uint32        current[MAX_PERFT_DEPTH + 1];     // index of the move being searched
+};
 
-#define STOP_TIMER \
-    QueryPerformanceCounter(&count2); \
-    gTime = ((double)(count2.QuadPart-count1.QuadPart)*1000.0)/freq.QuadPart; \
+static THREAD_LOCAL PerftStack perftStack;
+
+// perft without recursion (no call overhead, no per call copies of position and move list)
+template <class Generator>
+uint64 perftIterative(BoardPosition *pos, int depth)
+{
+    PerftStack *stack = &perftStack;
+    uint32 childMaxMoves;
+
+    assert(depth <= MAX_PERFT_DEPTH);
+
+    stack->positions[0] = *pos;
+    stack->nMoves[0] = Generator::generateMoves(&stack->positions[0], stack->moves[0], &childMaxMoves);
+    stack->current[0] = 0;
+
+    if (depth == 1)
+    {
+        return stack->nMoves[0];
     }
-// for timing CPU code : end
 
+    uint64 count = 0;
+    int ply = 0;
+    for (;;)
+    {
+        if (stack->current[ply] == stack->nMoves[ply])
+        {
+            // all moves searched: back to the parent
+            if (ply == 0)
+                break;
+            ply--;
+            continue;
+        }
+
+        BoardPosition *newPos = &stack->positions[ply + 1];
+        *newPos = stack->positions[ply];
+        makeMove(newPos, stack->moves[ply][stack->current[ply]++]);
 
-int main()
+        uint32 nMoves = Generator::generateMoves(newPos, stack->moves[ply + 1], &childMaxMoves);
+        if (ply + 2 == depth)
+        {
+            // moves of newPos are the leaves
+            count += nMoves;
+            continue;
+        }
+
+        ply++;
+        stack->nMoves[ply] = nMoves;
+        stack->current[ply] = 0;
+    }
+
+    return count;
+}
+
+// perft search using the hash table
+// (pos->hash must be the zobrist hash of the position)
+template <class Generator>
+uint64 perftHashed(BoardPosition *pos, int depth, uint32 maxMoves)
+{
+    uint64 childPerft = 0;
+
+    // symmetric positions share the hash table entry
+    uint64 hash = pos->hash;
+    uint32 symmetry;
+    if (Zobrist::useSymmetry)
+        hash = Zobrist::canonicalHash(pos, &symmetry);
+
+    // perft 1 is just move generation, not worth a hash table lookup
+    if (depth >= 2 && PerftHashTable::probe(hash, depth, &childPerft))
+    {
+        return childPerft;
+    }
+
+    PackedMove *moves = ALLOC_MOVE_LIST(maxMoves);
+    uint32 childMaxMoves;
+
+    uint32 nMoves = Generator::generateMoves(pos, moves, &childMaxMoves);
+
+    if (depth == 1)
+    {
+        return nMoves;
+    }
+
+    for (uint32 i = 0; i < nMoves; i++)
+    {
+        BoardPosition newPos = *pos;
+        makeMove(&newPos, moves[i]);
+        newPos.hash = Zobrist::updateHash(pos, &newPos, moves[i]);
+        if (Zobrist::useSymmetry)
+            Zobrist::updateSymmetricHashes(pos, &newPos, moves[i]);
+        childPerft += perftHashed<Generator>(&newPos, depth - 1, childMaxMoves);
+    }
+
+    PerftHashTable::store(hash, depth, childPerft);
+    return childPerft;
+}
+
+template <class Generator>
+uint64 perftHashed(BoardPosition *pos, int depth)
+{
+    pos->hash = Zobrist::computeHash(pos);
+    if (Zobrist::useSymmetry)
+        Zobrist::computeSymmetricHashes(pos);
+    return perftHashed<Generator>(pos, depth, Generator::movesBound(pos));
+}
+
+// perftHashed makes a child move and probes the hash table for the child right away, so every probe
+// is a cache miss that stalls the search. Here all the children are made first and the buckets for
+// all of them are prefetched, so the cache misses of the siblings overlap (and are mostly done by the
+// time a child is visited)
+template <class Generator>
+uint64 perftHashedPrefetch(BoardPosition *pos, int depth, uint32 maxMoves)
+{
+    uint64 childPerft = 0;
+
+    uint64 hash = pos->hash;
+    uint32 symmetry;
+    if (Zobrist::useSymmetry)
+        hash = Zobrist::canonicalHash(pos, &symmetry);
+
+    if (depth >= 2 && PerftHashTable::probe(hash, depth, &childPerft))
+    {
+        return childPerft;
+    }
+
+    PackedMove *moves = ALLOC_MOVE_LIST(maxMoves);
+    uint32 childMaxMoves;
+
+    uint32 nMoves = Generator::generateMoves(pos, moves, &childMaxMoves);
+
+    if (depth == 1)
+    {
+        return nMoves;
+    }
+
+    BoardPosition *children = (BoardPosition *) _alloca(nMoves * sizeof(BoardPosition));
+    for (uint32 i = 0; i < nMoves; i++)
+    {
+        BoardPosition *newPos = &children[i];
+        *newPos = *pos;
+        makeMove(newPos, moves[i]);
+        newPos->hash = Zobrist::updateHash(pos, newPos, moves[i]);
+
+        uint64 childHash = newPos->hash;
+        if (Zobrist::useSymmetry)
+        {
+            Zobrist::updateSymmetricHashes(pos, newPos, moves[i]);
+            childHash = Zobrist::canonicalHash(newPos, &symmetry);
+        }
+
+        if (depth - 1 >= 2)
+            PerftHashTable::prefetch(childHash, depth - 1);
+    }
+
+    for (uint32 i = 0; i < nMoves; i++)
+    {
+        childPerft += perftHashedPrefetch<Generator>(&children[i], depth - 1, childMaxMoves);
+    }
+
+    PerftHashTable::store(hash, depth, childPerft);
+    return childPerft;
+}
+
+template <class Generator>
+uint64 perftHashedPrefetch(BoardPosition *pos, int depth)
+{
+    pos->hash = Zobrist::computeHash(pos);
+    if (Zobrist::useSymmetry)
+        Zobrist::computeSymmetricHashes(pos);
+    return perftHashedPrefetch<Generator>(pos, depth, Generator::movesBound(pos));
+}
+
+// perft for all depths from 1 to maxDepth in a single pass
+// counts[d] is incremented by the no of positions at ply d (i.e. counts[d] += perft(d) when called for the root)
+template <class Generator>
+void perftAllDepths(BoardPosition *pos, int ply, int maxDepth, uint32 maxMoves, uint64 *counts)
+{
+    PackedMove *moves = ALLOC_MOVE_LIST(maxMoves);
+    uint32 childMaxMoves;
+
+    uint32 nMoves = Generator::generateMoves(pos, moves, &childMaxMoves);
+    counts[ply + 1] += nMoves;
+
+    if (ply + 1 == maxDepth)
+    {
+        return;
+    }
+
+    for (uint32 i = 0; i < nMoves; i++)
+    {
+        BoardPosition newPos = *pos;
+        makeMove(&newPos, moves[i]);
+        perftAllDepths<Generator>(&newPos, ply + 1, maxDepth, childMaxMoves, counts);
+    }
+}
+
+template <class Generator>
+void perftAllDepths(BoardPosition *pos, int maxDepth, uint64 *counts)
+{
+    for (int i = 0; i <= maxDepth; i++)
+        counts[i] = 0;
+    counts[0] = 1;
+
+    if (maxDepth >= 1)
+        perftAllDepths<Generator>(pos, 0, maxDepth, Generator::movesBound(pos), counts);
+}
+
+// explicit instantiations (perft is also used by other files)
+template uint64 perft<MoveGenerator>(BoardPosition *pos, int depth);
+template uint64 perft<MoveGeneratorLUT>(BoardPosition *pos, int depth);
+template uint64 perftIterative<MoveGenerator>(BoardPosition *pos, int depth);
+template uint64 perftIterative<MoveGeneratorLUT>(BoardPosition *pos, int depth);
+template uint64 perftHashed<MoveGenerator>(BoardPosition *pos, int depth);
+template uint64 perftHashed<MoveGeneratorLUT>(BoardPosition *pos, int depth);
+template uint64 perftHashedPrefetch<MoveGenerator>(BoardPosition *pos, int depth);
+template uint64 perftHashedPrefetch<MoveGeneratorLUT>(BoardPosition *pos, int depth);
+template void perftAllDepths<MoveGenerator>(BoardPosition *pos, int maxDepth, uint64 *counts);
+template void perftAllDepths<MoveGeneratorLUT>(BoardPosition *pos, int maxDepth, uint64 *counts);
+
+double gTime;
+
+static void printUsage()
+{
+    printf("usage: perft [options]\n");
+    printf("  -uci               UCI interface (see UciInterface.cpp)\n");
+    printf("  -fen <fen>         position to run perft on (default: position 2)\n");
+    printf("  -depth <n>         run perft only for depth n (default: depths 1 to 7)\n");
+    printf("  -journal <file>    resumable perft: record progress in (and resume from) the journal file\n");
+    printf("  -alldepths         perft for all depths up to -depth (default 7) in a single pass\n");
+    printf("  -iterative         perft without recursion (explicit stack)\n");
+    printf("  -hash <MB>         use a hash table of the given size\n");
+    printf("  -hashfile <file>   keep the hash table in a memory mapped file (reused by later runs)\n");
+    printf("  -frontier <k>      merge identical positions at ply k, then perft the unique ones in parallel\n");
+    printf("  -prefetch          (with -hash) make all children and prefetch their hash entries before visiting them\n");
+    printf("  -symmetry          hash table and frontier treat color flipped/mirrored positions as the same\n");
+    printf("  -frontierdir <dir> keep the frontier in files in dir (for frontiers that don't fit in memory)\n");
+    printf("  -frontiermem <MB>  memory for the frontier in files (default 1024)\n");
+    printf("  -estimate <sec>    monte carlo estimate of perft -depth, sampling for the given time\n");
+    printf("  -walkers <n>       (with -hash) interleave n perft walkers on each thread to hide hash table misses\n");
+    printf("                     (runs on the positions of the frontier: -frontier defaults to 2)\n");
+    printf("  -numa              pin worker threads to cpus of the NUMA nodes in turn, interleave the hash table\n");
+    printf("  -numapartition     same, with a hash table for every node in its local memory\n");
+    printf("  -numanodes <n>     use only the first n NUMA nodes (e.g. 1 vs 2 socket comparisons)\n");
+    printf("  -server <socket>   job server: reads perft jobs from clients of the unix domain socket, or stdin if '-'\n");
+    printf("                     (see PerftServer.cpp), the hash table (-hash, default 256 MB) is kept between jobs\n");
+    printf("  -batch <file>      perft of the positions in the file (or stdin if '-'), \"[<depth>] <fen>\" lines,\n");
+    printf("                     on all the threads, counts are written in input order (see BatchPerft.cpp)\n");
+    printf("  -fenbench <file>   speed of the FEN parser and writer on the positions of the file (one per line),\n");
+    printf("                     or of unpacking the positions of a corpus file\n");
+    printf("  -makecorpus <in> <out> writes the positions of a FEN/EPD file to a binary corpus file (see\n");
+    printf("                     PositionCorpus.cpp), which -batch and -fenbench read with no parsing\n");
+    printf("  -dump <file>       writes the positions at -depth to the file: packed and compressed (see LeafDump.cpp),\n");
+    printf("                     or with -dumpfen as FEN lines (stdout if '-')\n");
+    printf("  -dumpunique        (with -dump) every unique position once, merged in -frontierdir (default .)\n");
+    printf("  -sample <k>        uniform random sample of k positions at -depth, as FEN lines on stdout (or to the\n");
+    printf("                     -dump file) [-seed <n>: repeatable with -threads 1]\n");
+    printf("  -distribute <n>    distributed perft: n local worker processes (see DistributedPerft.cpp)\n");
+    printf("  -split <k>         (with -distribute) work units are the positions at ply k (default 2)\n");
+    printf("  -port <p>          (with -distribute) listen for workers on TCP port p (of localhost)\n");
+    printf("  -bind <addr>       (with -distribute) listen on this IPv4 address (e.g. 0.0.0.0) for workers on other\n");
+    printf("                     hosts (no authentication: trusted networks only)\n");
+    printf("  -worker <host:port> run work units for the coordinator at host:port (with its own -hash)\n");
+    printf("  -threads <n>       no of threads for parallel perft (default: one per hardware thread)\n");
+}
+
+int main(int argc, char *argv[])
 {
     BoardPosition testBoard;
 
     // some test board positions from http://chessprogramming.wikispaces.com/Perft+Results
 
-    //Utils::readFENString("rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1", &testBoard); // start.. 20 positions
-    Utils::readFENString("r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq -", &testBoard); // position 2 (caught max bugs for me)
-    //Utils::readFENString("8/2p5/3p4/KP5r/1R3p1k/8/4P1P1/8 w - -", &testBoard); // position 3
-    //Utils::readFENString("r2q1rk1/pP1p2pp/Q4n2/bbp1p3/Np6/1B3NBn/pPPP1PPP/R3K2R b KQ - 0 1", &testBoard); // position 4
-    //Utils::readFENString("r3k2r/Pppp1ppp/1b3nbN/nP6/BBP1P3/q4N2/Pp1P2PP/R2Q1RK1 w kq - 0 1", &testBoard); // mirror of position 4
-    //Utils::readFENString("rnbqkb1r/pp1p1ppp/2p5/4P3/2B5/8/PPP1NnPP/RNBQK2R w KQkq - 0 6", &testBoard);   // position 5
-    //Utils::readFENString("3Q4/1Q4Q1/4Q3/2Q4R/Q4Q2/3Q4/1Q4Rp/1K1BBNNk w - - 0 1", &testBoard); // - 218 positions.. correct!
+    //const char *fen = "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1"; // start.. 20 positions
+    const char *fen = "r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq -"; // position 2 (caught max bugs for me)
+    //const char *fen = "8/2p5/3p4/KP5r/1R3p1k/8/4P1P1/8 w - -"; // position 3
+    //const char *fen = "r2q1rk1/pP1p2pp/Q4n2/bbp1p3/Np6/1B3NBn/pPPP1PPP/R3K2R b KQ - 0 1"; // position 4
+    //const char *fen = "r3k2r/Pppp1ppp/1b3nbN/nP6/BBP1P3/q4N2/Pp1P2PP/R2Q1RK1 w kq - 0 1"; // mirror of position 4
+    //const char *fen = "rnbqkb1r/pp1p1ppp/2p5/4P3/2B5/8/PPP1NnPP/RNBQK2R w KQkq - 0 6";   // position 5
+    //const char *fen = "3Q4/1Q4Q1/4Q3/2Q4R/Q4Q2/3Q4/1Q4Rp/1K1BBNNk w - - 0 1"; // - 218 positions.. correct!
+
+    int depth = 0;
+    const char *journalFile = NULL;
+    uint64 hashSizeInMB = 0;
+    const char *hashFile = NULL;
+    bool allDepths = false;
+    int frontierDepth = 0;
+    const char *frontierDir = NULL;
+    const char *serverSocket = NULL;
+    bool server = false;
+    const char *coordinator = NULL;
+    const char *batchInput = NULL;
+    bool batch = false;
+    const char *fenBenchmarkInput = NULL;
+    const char *corpusInput = NULL;
+    const char *corpusOutput = NULL;
+    const char *dumpFile = NULL;
+    bool dumpFen = false;
+    bool dumpUnique = false;
+    uint64 sampleSize = 0;
+    uint64 sampleSeed = 0;
+    bool distributed = false;
+    uint32 nLocalWorkers = 0;
+    int splitDepth = 2;
+    int port = 0;
+    const char *bindAddress = NULL;
+    double estimateTime = 0;
+    bool prefetch = false;
+    bool iterative = false;
+    bool numa = false;
+    uint32 numaNodes = MAX_NUMA_NODES;
+    uint64 frontierMemoryInMB = 1024;
+
+    // command line options
+    for (int i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "-uci"))
+        {
+            UciInterface::processCommands();
+            return 0;
+        }
+        else if (!strcmp(argv[i], "-fen") && i + 1 < argc)
+        {
+            fen = argv[++i];
+        }
+        else if (!strcmp(argv[i], "-depth") && i + 1 < argc)
+        {
+            depth = atoi(argv[++i]);
+
+            // the stacks and the hash keys are sized for MAX_PERFT_DEPTH plies
+            if (depth < 1 || depth >= MAX_PERFT_DEPTH)
+            {
+                printf("invalid depth: %s (1 to %d)\n", argv[i], MAX_PERFT_DEPTH - 1);
+                return 1;
+            }
+        }
+        else if (!strcmp(argv[i], "-journal") && i + 1 < argc)
+        {
+            journalFile = argv[++i];
+        }
+        else if (!strcmp(argv[i], "-alldepths"))
+        {
+            allDepths = true;
+        }
+        else if (!strcmp(argv[i], "-hash") && i + 1 < argc)
+        {
+            hashSizeInMB = atoi(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "-hashfile") && i + 1 < argc)
+        {
+            hashFile = argv[++i];
+        }
+        else if (!strcmp(argv[i], "-frontier") && i + 1 < argc)
+        {
+            frontierDepth = atoi(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "-iterative"))
+        {
+            iterative = true;
+        }
+        else if (!strcmp(argv[i], "-prefetch"))
+        {
+            prefetch = true;
+        }
+        else if (!strcmp(argv[i], "-symmetry"))
+        {
+            Zobrist::useSymmetry = true;
+        }
+        else if (!strcmp(argv[i], "-frontierdir") && i + 1 < argc)
+        {
+            frontierDir = argv[++i];
+        }
+        else if (!strcmp(argv[i], "-frontiermem") && i + 1 < argc)
+        {
+            frontierMemoryInMB = atoi(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "-estimate") && i + 1 < argc)
+        {
+            estimateTime = atof(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "-walkers") && i + 1 < argc)
+        {
+            ParallelPerft::walkersPerThread = atoi(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "-numa"))
+        {
+            numa = true;
+        }
+        else if (!strcmp(argv[i], "-numapartition"))
+        {
+            numa = true;
+            Numa::partitioned = true;
+        }
+        else if (!strcmp(argv[i], "-numanodes") && i + 1 < argc)
+        {
+            numa = true;
+            numaNodes = atoi(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "-server") && i + 1 < argc)
+        {
+            server = true;
+            serverSocket = argv[++i];
+            if (!strcmp(serverSocket, "-"))
+                serverSocket = NULL;
+        }
+        else if (!strcmp(argv[i], "-batch") && i + 1 < argc)
+        {
+            batch = true;
+            batchInput = argv[++i];
+            if (!strcmp(batchInput, "-"))
+                batchInput = NULL;
+        }
+        else if (!strcmp(argv[i], "-fenbench") && i + 1 < argc)
+        {
+            fenBenchmarkInput = argv[++i];
+        }
+        else if (!strcmp(argv[i], "-makecorpus") && i + 2 < argc)
+        {
+            corpusInput = argv[++i];
+            corpusOutput = argv[++i];
+        }
+        else if (!strcmp(argv[i], "-dump") && i + 1 < argc)
+        {
+            dumpFile = argv[++i];
+        }
+        else if (!strcmp(argv[i], "-dumpfen"))
+        {
+            dumpFen = true;
+        }
+        else if (!strcmp(argv[i], "-dumpunique"))
+        {
+            dumpUnique = true;
+        }
+        else if (!strcmp(argv[i], "-sample") && i + 1 < argc)
+        {
+            sampleSize = strtoull(argv[++i], NULL, 10);
+        }
+        else if (!strcmp(argv[i], "-seed") && i + 1 < argc)
+        {
+            sampleSeed = strtoull(argv[++i], NULL, 10);
+        }
+        else if (!strcmp(argv[i], "-distribute") && i + 1 < argc)
+        {
+            distributed = true;
+            nLocalWorkers = atoi(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "-split") && i + 1 < argc)
+        {
+            splitDepth = atoi(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "-bind") && i + 1 < argc)
+        {
+            bindAddress = argv[++i];
+        }
+        else if (!strcmp(argv[i], "-port") && i + 1 < argc)
+        {
+            port = atoi(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "-worker") && i + 1 < argc)
+        {
+            coordinator = argv[++i];
+        }
+        else if (!strcmp(argv[i], "-threads") && i + 1 < argc)
+        {
+            ParallelPerft::nThreads = atoi(argv[++i]);
+        }
+        else
+        {
+            printUsage();
+            return 1;
+        }
+    }
+
+    if (fenBenchmarkInput)
+        return FenBenchmark::run(fenBenchmarkInput);
+
+    if (corpusInput)
+        return PositionCorpus::convert(corpusInput, corpusOutput);
+
+    const char *fenError;
+    if (!Utils::parseFEN(fen, &testBoard, &fenError))
+    {
+        printf("invalid FEN (%s): %s\n", fenError, fen);
+        return 1;
+    }
+
+    // must be known before the hash table is allocated
+    if (numa)
+        Numa::init(numaNodes);
+
+    // the server keeps a hash table for all its jobs
+    if ((hashFile || server) && !hashSizeInMB)
+        hashSizeInMB = 256;
+
+    // walkers run on the positions of the frontier
+    if (ParallelPerft::walkersPerThread > 1 && hashSizeInMB && !frontierDepth)
+        frontierDepth = 2;
+
+    // the coordinator of distributed perft doesn't need a hash table: the workers have their own
+    uint64 workerHashSizeInMB = hashSizeInMB;
+    if (distributed)
+        hashSizeInMB = 0;
+
+    if (hashSizeInMB && !PerftHashTable::init(hashSizeInMB, hashFile))
+    {
+        printf("can't allocate the hash table\n");
+        return 1;
+    }
+
+    if (server)
+        return PerftServer::run(serverSocket, hashSizeInMB != 0);
+
+    if (coordinator)
+        return DistributedPerft::worker(coordinator, hashSizeInMB != 0);
+
+    if (batch)
+        return BatchPerft::run(batchInput, depth, hashSizeInMB != 0);
+
+    if (sampleSize)
+    {
+        if (depth < 1)
+        {
+            printf("-sample needs -depth\n");
+            return 1;
+        }
+        return LeafSampler::sample(&testBoard, depth, sampleSize, sampleSeed, dumpFile ? dumpFile : "-",
+                                   dumpFile ? dumpFen : true);
+    }
+
+    if (dumpFile)
+    {
+        if (depth < 1)
+        {
+            printf("-dump needs -depth\n");
+            return 1;
+        }
+        return LeafDump::dump(&testBoard, depth, dumpFile, dumpFen, dumpUnique, frontierDir ? frontierDir : ".",
+                              frontierMemoryInMB);
+    }
 
     Utils::dispBoard(&testBoard);
 
@@ -216,21 +750,101 @@ int main()
     //printf("\nMoves generated: %d\n", nMoves);
 
 
-    //MoveGeneratorLUT::init();
     //nMoves = MoveGeneratorLUT::generateMoves(&testBoard, moves);
     //printf("\nMoves generated by LUT: %d\n", nMoves);
 
     
     
-    for (int depth=1;depth<8;depth++)
+    if (journalFile)
     {
+        if (depth < 1)
+        {
+            printf("-journal needs -depth\n");
+            return 1;
+        }
+
         uint64 leafNodes;
         START_TIMER
-        leafNodes = perft<MoveGenerator>(&testBoard, depth);
+        leafNodes = PerftJournal::perft(&testBoard, fen, depth, journalFile);
+        STOP_TIMER
+        if (leafNodes == (uint64) -1)
+            return 1;
+        printf("\nPerft %d: %llu,   ", depth, leafNodes);
+        printf("Time taken: %g seconds\n", gTime/1000.0);
+        return 0;
+    }
+
+    if (estimateTime > 0)
+    {
+        if (depth < 1)
+        {
+            printf("-estimate needs -depth\n");
+            return 1;
+        }
+
+        PerftEstimate result = PerftEstimator::estimate(&testBoard, depth, estimateTime);
+        printf("\nEstimated perft %d: %.6e +- %.2e (95%% confidence, %.3f%%), %llu samples on %u threads\n",
+               depth, result.estimate, result.confidence, 100.0 * result.confidence / (result.estimate + 1e-300),
+               result.samples, ParallelPerft::threadCount());
+        return 0;
+    }
+
+    if (allDepths)
+    {
+        uint64 counts[MAX_PERFT_DEPTH + 1];
+        int maxDepth = depth ? depth : 7;
+        if (maxDepth > MAX_PERFT_DEPTH)
+            maxDepth = MAX_PERFT_DEPTH;
+
+        START_TIMER
+        perftAllDepths<MoveGenerator>(&testBoard, maxDepth, counts);
+        STOP_TIMER
+        printf("\n");
+        for (depth = 1; depth <= maxDepth; depth++)
+            printf("Perft %d: %llu\n", depth, counts[depth]);
+        printf("Time taken: %g seconds\n", gTime/1000.0);
+        return 0;
+    }
+
+    int minDepth = depth ? depth : 1;
+    int maxDepth = depth ? depth : 7;
+    for (depth=minDepth;depth<=maxDepth;depth++)
+    {
+        uint64 leafNodes;
+        START_TIMER
+        if (distributed)
+            leafNodes = DistributedPerft::perft(fen, depth, splitDepth, nLocalWorkers, port, bindAddress,
+                                                workerHashSizeInMB);
+        else if (frontierDepth && frontierDir)
+            leafNodes = ExternalFrontier::perft(&testBoard, depth, frontierDepth, hashSizeInMB != 0, frontierDir,
+                                                frontierMemoryInMB);
+        else if (frontierDepth)
+            leafNodes = FrontierPerft::perft(&testBoard, depth, frontierDepth, hashSizeInMB != 0);
+        else if (hashSizeInMB && prefetch)
+            leafNodes = perftHashedPrefetch<MoveGenerator>(&testBoard, depth);
+        else if (hashSizeInMB)
+            leafNodes = perftHashed<MoveGenerator>(&testBoard, depth);
+        else if (iterative)
+            leafNodes = perftIterative<MoveGenerator>(&testBoard, depth);
+        else
+            leafNodes = perft<MoveGenerator>(&testBoard, depth);
         STOP_TIMER
         printf("\nPerft %d: %llu,   ", depth, leafNodes);
         printf("Time taken: %g seconds, nps: %llu\n", gTime/1000.0, (uint64) ((leafNodes/gTime)*1000.0));
     }
+
+    if (frontierDepth)
+    {
+        printf("\n");
+        ParallelPerft::printThreadStats();
+    }
+
+    if (hashSizeInMB)
+    {
+        printf("\nHash table probes: %llu, hits: %llu (%.2f%%)\n", PerftHashTable::probes, PerftHashTable::hits,
+               100.0 * PerftHashTable::hits / (PerftHashTable::probes + 1e-9));
+        PerftHashTable::release();
+    }
 /*
     START_TIMER
     leafNodes = perft<MoveGeneratorLUT>(&testBoard, depth);
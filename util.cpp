@@ -215,6 +215,140 @@ void Utils::displayMove(Move move)
     printf(dispString);
 }
 
+// gets a move in UCI notation (castling is just the king's move, e.g: e1g1)
+void Utils::getMoveString(Move move, char str[6])
+{
+    static const char promotionChar[] = {0, 0, 0, 0, 'q', 'r', 'b', 'n'};
+
+    str[0] = FILE(move.src) + 'a';
+    str[1] = RANK(move.src) + '1';
+    str[2] = FILE(move.dst) + 'a';
+    str[3] = RANK(move.dst) + '1';
+    str[4] = promotionChar[move.flags];
+    str[5] = 0;
+}
+
+// reads a move in UCI notation
+// the move is looked up in the list of legal moves so that special moves (castling, en-passent) get the right flags
+bool Utils::readMove(const char str[], BoardPosition *pos, Move *move)
+{
+    if (!(str[0] >= 'a' && str[0] <= 'h' && str[1] >= '1' && str[1] <= '8' &&
+          str[2] >= 'a' && str[2] <= 'h' && str[3] >= '1' && str[3] <= '8'))
+        return false;
+
+    uint32 src = INDEX088(str[1] - '1', str[0] - 'a');
+    uint32 dst = INDEX088(str[3] - '1', str[2] - 'a');
+    char promotion = str[4];
+    if (promotion >= 'A' && promotion <= 'Z')
+        promotion += ('a' - 'A');
+
+    Move moves[MAX_MOVES];
+    int nMoves = MoveGenerator::generateMoves(pos, moves);
+    for (int i = 0; i < nMoves; i++)
+    {
+        if (moves[i].src == src && moves[i].dst == dst)
+        {
+            char moveStr[6];
+            getMoveString(moves[i], moveStr);
+            if (moveStr[4] == 0 || moveStr[4] == promotion)
+            {
+                *move = moves[i];
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
+
+void Utils::transformPosition(BoardPosition *pos, uint32 symmetry, BoardPosition *image)
+{
+    memset(image, 0, sizeof(BoardPosition));
+
+    uint32 squareXor = ((symmetry & SYMMETRY_FLIP) ? 0x70 : 0) | ((symmetry & SYMMETRY_MIRROR) ? 0x07 : 0);
+    for (uint32 i = 0; i < 64; i++)
+    {
+        uint32 sq = INDEX088_FROM64(i);
+        uint8 piece = pos->board[sq];
+        if (!ISEMPTY(piece) && (symmetry & SYMMETRY_FLIP))
+        {
+            uint32 color = !COLOR(piece), pieceType = PIECE(piece);
+            piece = COLOR_PIECE(color, pieceType);
+        }
+        image->board[sq ^ squareXor] = piece;
+    }
+
+    if (symmetry & SYMMETRY_FLIP)
+    {
+        image->chance      = !pos->chance;
+        image->whiteCastle = pos->blackCastle;
+        image->blackCastle = pos->whiteCastle;
+    }
+    else
+    {
+        image->chance      = pos->chance;
+        image->whiteCastle = pos->whiteCastle;
+        image->blackCastle = pos->blackCastle;
+    }
+
+    image->enPassent = pos->enPassent;
+    if (pos->enPassent && (symmetry & SYMMETRY_MIRROR))
+        image->enPassent = 9 - pos->enPassent;
+}
+
+void Utils::packPosition(BoardPosition *pos, PackedPosition *packed)
+{
+    memset(packed, 0, sizeof(PackedPosition));
+
+    // without branches on the contents of the squares (an empty square ors a zero code into the next slot)
+    uint64 occupied = 0;
+    uint32 n = 0;
+    for (uint32 i = 0; i < 64; i++)
+    {
+        uint8 piece = pos->board[INDEX088_FROM64(i)];
+        uint32 isOccupied = !ISEMPTY(piece);
+        occupied |= (uint64) isOccupied << i;
+        packed->pieces[(n / 2) & 15] |= (COLOR(piece) << 3 | PIECE(piece)) << ((n & 1) * 4);
+        n += isOccupied;
+    }
+    assert(n <= 32);     // not more than 32 pieces in a legal position
+    packed->occupied = occupied;
+
+    packed->chance      = pos->chance;
+    packed->whiteCastle = pos->whiteCastle;
+    packed->blackCastle = pos->blackCastle;
+    packed->enPassent   = pos->enPassent;
+}
+
+// board piece codes of the 4 bit codes of packed positions (color << 3 | piece)
+static const uint8 packedPieceCodes[16] =
+{
+    EMPTY_SQUARE, COLOR_PIECE(WHITE, PAWN), COLOR_PIECE(WHITE, KNIGHT), COLOR_PIECE(WHITE, BISHOP),
+    COLOR_PIECE(WHITE, ROOK), COLOR_PIECE(WHITE, QUEEN), COLOR_PIECE(WHITE, KING), EMPTY_SQUARE,
+    EMPTY_SQUARE, COLOR_PIECE(BLACK, PAWN), COLOR_PIECE(BLACK, KNIGHT), COLOR_PIECE(BLACK, BISHOP),
+    COLOR_PIECE(BLACK, ROOK), COLOR_PIECE(BLACK, QUEEN), COLOR_PIECE(BLACK, KING), EMPTY_SQUARE
+};
+
+void Utils::unpackPosition(const PackedPosition *packed, BoardPosition *pos)
+{
+    memset(pos, 0, sizeof(BoardPosition));
+
+    // only the occupied squares are visited
+    uint32 n = 0;
+    for (uint64 occupied = packed->occupied; occupied; occupied &= occupied - 1)
+    {
+        uint32 i = bitScanForward(occupied);
+        uint32 code = (packed->pieces[n / 2] >> ((n & 1) * 4)) & 0xF;
+        pos->board[INDEX088_FROM64(i)] = packedPieceCodes[code];
+        n++;
+    }
+
+    pos->chance      = packed->chance;
+    pos->whiteCastle = packed->whiteCastle;
+    pos->blackCastle = packed->blackCastle;
+    pos->enPassent   = packed->enPassent;
+}
+
 
 // reads a FEN string into the given BoardPosition object
 
@@ -230,99 +364,456 @@ A FEN record contains 6 fields. The separator between fields is a space. The fie
    5. Halfmove clock: This is the number of halfmoves since the last pawn advance or capture. This is used to determine if a draw can be claimed under the fifty move rule.
    6. Fullmove number: The number of the full move. It starts at 1, and is incremented after Black's move.
 
+An EPD record has only the first 4 fields, followed by operations (e.g. "bm e4; id \"test 1\";"), so the
+clocks are optional: anything after the fields read is left to the caller.
+
 */
-void Utils::readFENString(char fen[], BoardPosition *pos) 
+
+static inline bool isFENBlank(char c)
 {
-	int i, j;
-	char curChar;
-	int row = 0, col = 0;
+    return c == ' ' || c == '\t';
+}
 
-    memset(pos, 0, sizeof(BoardPosition));
+static inline bool isFENEnd(char c)
+{
+    return !c || c == '\r' || c == '\n';
+}
 
-	// 1. read the board
-	for(i=0;fen[i];i++) 
+// 0x88 attack table, built by the compiler: for every color, and the difference between two squares (+ 0x77,
+// so that it's never negative), the pieces that can attack one square from the other on an empty board
+// (bit i set for piece code i), and the step from the attacker to the target (along the ray for sliding
+// pieces, the whole difference for knights)
+// also, for every square (0-63), the squares from which a knight, a king or a pawn of each color attacks it,
+// and the squares on its rank and file, and on its diagonals (from where a sliding piece may attack it)
+struct AttackTable
+{
+    uint32 attackers[2][240];
+    uint32 step[240];
+    uint64 knightAttackers[64];
+    uint64 kingAttackers[64];
+    uint64 pawnAttackers[2][64];
+    uint64 rookLines[64];
+    uint64 bishopLines[64];
+
+    constexpr AttackTable() : attackers(), step(), knightAttackers(), kingAttackers(), pawnAttackers(), rookLines(),
+                              bishopLines()
     {
-		curChar = fen[i];
+        const int kingDirections[]   = { 0x10, -0x10, 0x1, -0x1, 0xf, 0x11, -0x11, -0xf };
+        const int knightDirections[] = { 0x1f, 0x21, 0xe, 0x12, -0x12, -0xe, -0x21, -0x1f };
+
+        for (uint32 color = WHITE; color <= BLACK; color++)
+        {
+            for (uint32 d = 0; d < 8; d++)
+            {
+                uint32 slider = (d < 4) ? COLOR_PIECE(color, ROOK) : COLOR_PIECE(color, BISHOP);
+                for (int distance = 1; distance < 8; distance++)
+                {
+                    int delta = kingDirections[d] * distance + 0x77;
+                    attackers[color][delta] |= BIT(slider) | BIT(COLOR_PIECE(color, QUEEN));
+                    step[delta] = (uint32) kingDirections[d];
+                }
+                attackers[color][kingDirections[d] + 0x77] |= BIT(COLOR_PIECE(color, KING));
+
+                attackers[color][knightDirections[d] + 0x77] |= BIT(COLOR_PIECE(color, KNIGHT));
+                step[knightDirections[d] + 0x77] = (uint32) knightDirections[d];
+            }
 
+            int forward = (color == WHITE) ? 0x10 : -0x10;
+            attackers[color][forward - 1 + 0x77] |= BIT(COLOR_PIECE(color, PAWN));
+            attackers[color][forward + 1 + 0x77] |= BIT(COLOR_PIECE(color, PAWN));
+        }
 
-		if(curChar=='/'||curChar=='\\') 
+        for (uint32 target = 0; target < 64; target++)
         {
-			row++; col=0;
-		}
-		else if(curChar >= '1' && curChar <= '8') 
-        {	// blank squares
-			for(j = 0; j < curChar - '0'; j++)
+            int target088 = (int) INDEX088_FROM64(target);
+            for (uint32 d = 0; d < 8; d++)
             {
-                pos->board[INDEX088(7-row, col)] = getPieceCode(curChar);
-				col++;
+                int knight = target088 - knightDirections[d], king = target088 - kingDirections[d];
+                if (!(knight & 0x88))
+                    knightAttackers[target] |= 1ULL << INDEX64(knight);
+                if (!(king & 0x88))
+                    kingAttackers[target] |= 1ULL << INDEX64(king);
+
+                uint64 *lines = (d < 4) ? &rookLines[target] : &bishopLines[target];
+                for (int square = target088 + kingDirections[d]; !(square & 0x88); square += kingDirections[d])
+                    *lines |= 1ULL << INDEX64(square);
             }
-		}
-		else if(curChar=='k'||curChar=='q'||curChar=='r'||curChar=='b'||curChar=='n'||curChar=='p' ||
-				curChar=='K'||curChar=='Q'||curChar=='R'||curChar=='B'||curChar=='N'||curChar=='P') 
+
+            // a white pawn attacks from the rank below, a black pawn from the rank above
+            for (int side = -1; side <= 1; side += 2)
+            {
+                int white = target088 - 0x10 + side, black = target088 + 0x10 + side;
+                if (!(white & 0x88))
+                    pawnAttackers[WHITE][target] |= 1ULL << INDEX64(white);
+                if (!(black & 0x88))
+                    pawnAttackers[BLACK][target] |= 1ULL << INDEX64(black);
+            }
+        }
+    }
+};
+
+static constexpr AttackTable attackTable;
+
+// whether a piece of the given color attacks the target square (0x88 index)
+// pieceBits: the squares (0-63) of the pieces, by piece code; only sliding pieces need a look at the board
+static bool isAttackedBy(BoardPosition *pos, const uint64 pieceBits[32], uint32 color, uint32 target)
+{
+    uint32 target64 = INDEX64(target);
+    if ((attackTable.knightAttackers[target64] & pieceBits[COLOR_PIECE(color, KNIGHT)]) ||
+        (attackTable.kingAttackers[target64] & pieceBits[COLOR_PIECE(color, KING)]) ||
+        (attackTable.pawnAttackers[color][target64] & pieceBits[COLOR_PIECE(color, PAWN)]))
+        return true;
+
+    // sliding pieces on a line through the target: only the squares in between are left to check
+    uint64 queens = pieceBits[COLOR_PIECE(color, QUEEN)];
+    uint64 sliders = (attackTable.rookLines[target64] & (pieceBits[COLOR_PIECE(color, ROOK)] | queens)) |
+                     (attackTable.bishopLines[target64] & (pieceBits[COLOR_PIECE(color, BISHOP)] | queens));
+    for (; sliders; sliders &= sliders - 1)
+    {
+        uint32 square = INDEX088_FROM64(bitScanForward(sliders));
+        uint32 step = attackTable.step[target - square + 0x77];
+        uint32 sq = square + step;
+        while (sq != target && ISEMPTY(pos->board[sq]))
+            sq += step;
+        if (sq == target)
+            return true;
+    }
+    return false;
+}
+
+// the characters of the board field of a FEN: the no of squares they describe (1 for a piece letter, n for
+// the digit n, 0 for anything else) and the piece code (EMPTY_SQUARE for digits)
+// with a lookup instead of tests for the different characters, reading the board has few branches
+struct FenBoardChars
+{
+    uint8 width[256];
+    uint8 codes[256];
+
+    constexpr FenBoardChars() : width(), codes()
+    {
+        const char letters[] = "PNBRQK";
+        for (uint32 piece = PAWN; piece <= KING; piece++)
         {
-            pos->board[INDEX088(7 - row, col)] = getPieceCode(curChar);
-			col++;
-		}
+            uint8 white = (uint8) letters[piece - PAWN], black = (uint8) (white + 'a' - 'A');
+            width[white] = width[black] = 1;
+            codes[white] = COLOR_PIECE(WHITE, piece);
+            codes[black] = COLOR_PIECE(BLACK, piece);
+        }
 
-		if(row >= 7 && col == 8) break;		// done with the board, set the flags now
-		
-	}
+        for (uint32 n = 1; n <= 8; n++)
+            width['0' + n] = (uint8) n;
+    }
+};
+
+static constexpr FenBoardChars fenBoardChars;
+
+// sets the error and clears the position (so that a half read board can't be used by mistake)
+static bool fenError(BoardPosition *pos, const char **error, const char *message)
+{
+    memset(pos, 0, sizeof(BoardPosition));
+    if (error)
+        *error = message;
+    return false;
+}
 
-	i++;
-	
-	// 2. read the chance
-	while(fen[i]==' ') 
-        i++;
+// skips the blanks before a field, returns false if there are no more fields
+static bool nextFENField(const char **str)
+{
+    while (isFENBlank(**str))
+        (*str)++;
+    return !isFENEnd(**str);
+}
 
-	if(fen[i]=='b' || fen[i]=='B') 
+// reads a number that ends the field
+static bool readFENNumber(const char **str, int *value)
+{
+    const char *p = *str;
+    int n = 0;
+    while (*p >= '0' && *p <= '9')
     {
-        pos->chance = BLACK; 
+        if (n >= 100000000)
+            return false;
+        n = n * 10 + (*p++ - '0');
     }
-	else 
+
+    if (p == *str || !(isFENBlank(*p) || isFENEnd(*p)))
+        return false;
+
+    *value = n;
+    *str = p;
+    return true;
+}
+
+bool Utils::parseFEN(const char fen[], BoardPosition *pos, const char **error, int *halfMoveClock, int *fullMoveNumber)
+{
+    const char *p = fen;
+    uint64 pieceBits[32] = {0};     // squares (0-63) of the pieces by piece code
+
+    memset(pos, 0, sizeof(BoardPosition));
+
+    // 1. the board, from rank 8 to rank 1
+    if (!nextFENField(&p))
+        return fenError(pos, error, "empty FEN");
+
+    uint32 rank = 7, file = 0;
+    for (;; p++)
     {
+        uint32 c = (uint8) *p;
+        uint32 width = fenBoardChars.width[c];
+        if (width)
+        {
+            // a piece or a run of empty squares, which are written to the (cleared) board all the same
+            if (file + width > 8)
+                return fenError(pos, error, "too many squares in a rank");
+
+            uint32 code = fenBoardChars.codes[c];
+            pos->board[INDEX088(rank, file)] = (uint8) code;
+            pieceBits[code] |= 1ULL << (rank * 8 + file);
+            file += width;
+        }
+        else if (c == '/')
+        {
+            if (file != 8)
+                return fenError(pos, error, "too few squares in a rank");
+            if (rank == 0)
+                return fenError(pos, error, "too many ranks");
+            rank--;
+            file = 0;
+        }
+        else if (isFENBlank((char) c) || isFENEnd((char) c))
+        {
+            if (rank != 0 || file != 8)
+                return fenError(pos, error, "incomplete board");
+            break;
+        }
+        else
+        {
+            return fenError(pos, error, "invalid character in the board");
+        }
+    }
+
+    // 2. side to move
+    if (!nextFENField(&p))
+        return fenError(pos, error, "missing side to move");
+
+    if (*p == 'w')
         pos->chance = WHITE;
+    else if (*p == 'b')
+        pos->chance = BLACK;
+    else
+        return fenError(pos, error, "invalid side to move");
+    p++;
+
+    if (!isFENBlank(*p) && !isFENEnd(*p))
+        return fenError(pos, error, "invalid side to move");
+
+    // 3. castling rights
+    if (!nextFENField(&p))
+        return fenError(pos, error, "missing castling rights");
+
+    if (*p == '-')
+    {
+        p++;
+    }
+    else
+    {
+        for (; !isFENBlank(*p) && !isFENEnd(*p); p++)
+        {
+            uint8 *castle = (*p == 'K' || *p == 'Q') ? &pos->whiteCastle : &pos->blackCastle;
+            uint8 flag;
+            if (*p == 'K' || *p == 'k')
+                flag = CASTLE_FLAG_KING_SIDE;
+            else if (*p == 'Q' || *p == 'q')
+                flag = CASTLE_FLAG_QUEEN_SIDE;
+            else
+                return fenError(pos, error, "invalid castling rights");
+
+            if (*castle & flag)
+                return fenError(pos, error, "invalid castling rights");
+            *castle |= flag;
+        }
     }
 
-	i++;
-
-	// 3. read the castle flags
-    pos->whiteCastle = pos->blackCastle = 0;
-
-	while(fen[i]==' ') 
-        i++;
-
-	while(fen[i]!= ' ') {
-		switch(fen[i]) {
-		case 'k':
-            pos->blackCastle |= CASTLE_FLAG_KING_SIDE;
-			break;
-		case 'q':
-            pos->blackCastle |= CASTLE_FLAG_QUEEN_SIDE;
-			break;
-		case 'K':
-            pos->whiteCastle |= CASTLE_FLAG_KING_SIDE;
-			break;
-		case 'Q':
-            pos->whiteCastle |= CASTLE_FLAG_QUEEN_SIDE;
-			break;
-		}
-		i++;
-	}
+    if (!isFENBlank(*p) && !isFENEnd(*p))
+        return fenError(pos, error, "invalid castling rights");
+
+    // 4. en passant square
+    if (!nextFENField(&p))
+        return fenError(pos, error, "missing en passant square");
+
+    if (*p == '-')
+    {
+        p++;
+    }
+    else
+    {
+        uint32 epRank = (pos->chance == WHITE) ? 5 : 2;
+        if (p[0] < 'a' || p[0] > 'h' || p[1] != (char) ('1' + epRank))
+            return fenError(pos, error, "invalid en passant square");
+
+        // the pawn that just moved two squares is in front of the square, and the squares it passed are empty
+        uint32 epFile = p[0] - 'a';
+        uint32 square = INDEX088(epRank, epFile);
+        uint32 pawnSquare = (pos->chance == WHITE) ? square - 0x10 : square + 0x10;
+        uint32 fromSquare = (pos->chance == WHITE) ? square + 0x10 : square - 0x10;
+        uint32 pawnColor = !pos->chance;
+        if (pos->board[pawnSquare] != COLOR_PIECE(pawnColor, PAWN) || !ISEMPTY(pos->board[square]) ||
+            !ISEMPTY(pos->board[fromSquare]))
+            return fenError(pos, error, "en passant square without a pawn that just moved");
+
+        pos->enPassent = (uint8) (epFile + 1);
+        p += 2;
+    }
 
-	// 4. read en-passent flag
-    pos->enPassent = 0;
+    if (!isFENBlank(*p) && !isFENEnd(*p))
+        return fenError(pos, error, "invalid en passant square");
 
-	while(fen[i]==' ') 
-        i++;
+    // 5. the clocks (optional)
+    int halfMoves = 0, fullMoves = 1;
+    if (nextFENField(&p) && *p >= '0' && *p <= '9')
+    {
+        if (!readFENNumber(&p, &halfMoves))
+            return fenError(pos, error, "invalid halfmove clock");
 
-	if(fen[i] >= 'a' && fen[i] <= 'h')
-		pos->enPassent = fen[i] - 'a' + 1;
-	
-	while(fen[i]!=' ' && fen[i]) 
-        i++;
-	
-	//TODO: 5. read the half-move and the full move clocks
+        if (nextFENField(&p) && *p >= '0' && *p <= '9' && !readFENNumber(&p, &fullMoves))
+            return fenError(pos, error, "invalid fullmove number");
+    }
+
+    // 6. checks that need the whole position
+    uint64 whiteKing = pieceBits[COLOR_PIECE(WHITE, KING)], blackKing = pieceBits[COLOR_PIECE(BLACK, KING)];
+    if (!whiteKing || (whiteKing & (whiteKing - 1)) || !blackKing || (blackKing & (blackKing - 1)))
+        return fenError(pos, error, "there must be one king of each color");
+
+    for (uint32 color = WHITE; color <= BLACK; color++)
+    {
+        uint64 pieces = 0;
+        for (uint32 piece = PAWN; piece <= KING; piece++)
+            pieces |= pieceBits[COLOR_PIECE(color, piece)];
+        if (popCount(pieces) > 16 || popCount(pieceBits[COLOR_PIECE(color, PAWN)]) > 8)
+            return fenError(pos, error, "too many pieces");
+    }
+
+    if ((pieceBits[COLOR_PIECE(WHITE, PAWN)] | pieceBits[COLOR_PIECE(BLACK, PAWN)]) & 0xFF000000000000FFULL)
+        return fenError(pos, error, "pawn on the first or last rank");
+
+    for (uint32 color = WHITE; color <= BLACK; color++)
+    {
+        uint8 castle = (color == WHITE) ? pos->whiteCastle : pos->blackCastle;
+        uint32 homeRank = (color == WHITE) ? 0 : 7;
+        uint8 rook = COLOR_PIECE(color, ROOK);
+
+        if (castle && pos->board[INDEX088(homeRank, 4)] != COLOR_PIECE(color, KING))
+            return fenError(pos, error, "castling rights without the king on its square");
+        if ((castle & CASTLE_FLAG_KING_SIDE) && pos->board[INDEX088(homeRank, 7)] != rook)
+            return fenError(pos, error, "castling rights without the rook on its square");
+        if ((castle & CASTLE_FLAG_QUEEN_SIDE) && pos->board[INDEX088(homeRank, 0)] != rook)
+            return fenError(pos, error, "castling rights without the rook on its square");
+    }
+
+    // the move generator assumes that the king of the side not to move can't be captured
+    uint32 otherKing = pos->chance == WHITE ? COLOR_PIECE(BLACK, KING) : COLOR_PIECE(WHITE, KING);
+    if (isAttackedBy(pos, pieceBits, pos->chance, INDEX088_FROM64(bitScanForward(pieceBits[otherKing]))))
+        return fenError(pos, error, "the side not to move is in check");
+
+    if (halfMoveClock)
+        *halfMoveClock = halfMoves;
+    if (fullMoveNumber)
+        *fullMoveNumber = fullMoves;
+
+    return true;
+}
+
+void Utils::readFENString(const char fen[], BoardPosition *pos) 
+{
+    parseFEN(fen, pos);
+}
+
+// writes a (non negative) number, returns the end of it
+static char *writeFENNumber(char *str, uint32 n)
+{
+    char digits[10];
+    int len = 0;
+    do
+    {
+        digits[len++] = (char) ('0' + n % 10);
+        n /= 10;
+    } while (n);
+
+    while (len)
+        *str++ = digits[--len];
+    return str;
+}
+
+int Utils::getFENString(BoardPosition *pos, char fen[MAX_FEN_LENGTH], int halfMoveClock, int fullMoveNumber)
+{
+    char *p = fen;
+
+    // 1. the board
+    for (int rank = 7; rank >= 0; rank--)
+    {
+        int empty = 0;
+        for (int file = 0; file < 8; file++)
+        {
+            uint8 code = pos->board[INDEX088(rank, file)];
+            if (ISEMPTY(code))
+            {
+                empty++;
+                continue;
+            }
+
+            if (empty)
+                *p++ = (char) ('0' + empty);
+            empty = 0;
+            *p++ = getPieceChar(code);
+        }
+
+        if (empty)
+            *p++ = (char) ('0' + empty);
+        if (rank)
+            *p++ = '/';
+    }
+
+    // 2. side to move
+    *p++ = ' ';
+    *p++ = (pos->chance == WHITE) ? 'w' : 'b';
+
+    // 3. castling rights
+    *p++ = ' ';
+    char *castle = p;
+    if (pos->whiteCastle & CASTLE_FLAG_KING_SIDE)
+        *p++ = 'K';
+    if (pos->whiteCastle & CASTLE_FLAG_QUEEN_SIDE)
+        *p++ = 'Q';
+    if (pos->blackCastle & CASTLE_FLAG_KING_SIDE)
+        *p++ = 'k';
+    if (pos->blackCastle & CASTLE_FLAG_QUEEN_SIDE)
+        *p++ = 'q';
+    if (p == castle)
+        *p++ = '-';
+
+    // 4. en passant square
+    *p++ = ' ';
+    if (pos->enPassent)
+    {
+        *p++ = (char) ('a' + pos->enPassent - 1);
+        *p++ = (pos->chance == WHITE) ? '6' : '3';
+    }
+    else
+    {
+        *p++ = '-';
+    }
+
+    // 5. the clocks
+    if (halfMoveClock >= 0)
+    {
+        *p++ = ' ';
+        p = writeFENNumber(p, (uint32) halfMoveClock);
+        *p++ = ' ';
+        p = writeFENNumber(p, (uint32) fullMoveNumber);
+    }
 
+    *p = 0;
+    return (int) (p - fen);
 }
 
 